@@ -70,6 +70,8 @@
 int carp_preempt = 0;
 int carp_max_devices = 1;
 int carp_tx_queues = CARP_DEFAULT_TX_QUEUES;
+int carp_verify_batch = 0;
+int carp_prefilter = 0;
 
 /*---------------------------- Module parameters ----------------------------*/
 MODULE_PARM_DESC(preempt, "Pre-empt masters going down");
@@ -81,11 +83,16 @@ module_param_named(max_carps, carp_max_devices, int, 0444);
 MODULE_PARM_DESC(tx_queues, "Max number of transmit queues (default = 16)");
 module_param_named(tx_queues, carp_tx_queues, int, 0);
 
+MODULE_PARM_DESC(verify_batch, "Max advertisements verified per async batch (default = 0, verify synchronously)");
+module_param_named(verify_batch, carp_verify_batch, int, 0444);
+
+MODULE_PARM_DESC(prefilter, "Drop foreign and malformed advertisements in the carpdev's rx_handler (default = 0)");
+module_param_named(prefilter, carp_prefilter, int, 0644);
+
 /*----------------------------- Global variables ----------------------------*/
 int carp_net_id __read_mostly;
 
 static struct carp_net *cn_global;
-static void carp_del_all_timeouts(struct carp *);
 
 static int carp_dev_init(struct net_device *);
 static void carp_dev_uninit(struct net_device *);
@@ -95,9 +102,10 @@ static int carp_dev_open(struct net_device *);
 static int carp_dev_ioctl (struct net_device *, struct ifreq *, int);
 static int carp_check_params(struct carp *, struct carp_ioctl_params);
 
-static int carp_dev_xmit(struct sk_buff *, struct net_device *);
+static netdev_tx_t carp_dev_xmit(struct sk_buff *, struct net_device *);
 
-static struct net_device_stats *carp_dev_get_stats(struct net_device *);
+static struct rtnl_link_stats64 *carp_dev_get_stats64(struct net_device *,
+                                                      struct rtnl_link_stats64 *);
 
 static u32 inline addr2val(u8, u8, u8, u8);
 
@@ -112,32 +120,48 @@ static u32 inline addr2val(u8 a1, u8 a2, u8 a3, u8 a4)
     return htonl(ret);
 }
 
-struct carp *carp_get_by_vhid(u8 vhid)
-{
-    struct list_head *ptr;
-    struct carp *entry;
-
-    list_for_each(ptr, &cn_global->dev_list) {
-        entry = list_entry(ptr, struct carp, carp_list);
-        if (entry->vhid == vhid)
-            return entry;
-    }
-    return NULL;
-}
-
 /*----------------------------- Device functions ----------------------------*/
 static void carp_dev_uninit(struct net_device *dev)
 {
     struct carp *carp = netdev_priv(dev);
 
-    carp_del_all_timeouts(carp);
+    carp_node_destroy_all(carp);
+    carp_proto_peer_flush(carp);
+    carp_debug_unregister(carp);
     carp_remove_proc_entry(carp);
-    crypto_free_hash(carp->hash);
-    list_del(&(cn_global->dev_list));
+
+    /*
+     * Once out of the vhid table and past a grace period, the carp can no
+     * longer be found by the receive path. Queued verifications look the
+     * vhid up again when they complete, so they cannot reach it either, and
+     * nothing is left to schedule the owner tasklet but the md_timer. The
+     * tasklet is held off while the port goes so it cannot rearm on it.
+     */
+    tasklet_disable(&carp->owner);
+    carp_port_detach(carp);
+    synchronize_net();
+    tasklet_enable(&carp->owner);
+
+    carp_del_all_timeouts(carp);
+    carp_proto_sig_free(carp);
+    carp_crypto_free(carp);
+    carp_proto_free_adv(carp);
+    list_del(&carp->carp_list);
 
     if (carp->odev)
         dev_put(carp->odev);
     dev_put(dev);
+
+    /*
+     * A device that fails registration after ndo_init is released with
+     * free_netdev() alone, the destructor never runs for it.
+     */
+    if (dev->reg_state == NETREG_UNINITIALIZED) {
+        free_percpu(carp->pcpu_stats);
+        carp->pcpu_stats = NULL;
+        kfree(carp->cold);
+        carp->cold = NULL;
+    }
 }
 
 static int carp_check_params(struct carp *carp, struct carp_ioctl_params p)
@@ -162,12 +186,16 @@ static int carp_check_params(struct carp *carp, struct carp_ioctl_params p)
     return 0;
 }
 
-static void carp_del_all_timeouts(struct carp *carp)
+/*
+ * The owner tasklet arms the md_timer and the md_timer schedules the
+ * tasklet, so the tasklet is killed again once the timer is cancelled.
+ */
+void carp_del_all_timeouts(struct carp *carp)
 {
-    if (timer_pending(&carp->md_timer))
-        del_timer_sync(&carp->md_timer);
-    if (timer_pending(&carp->adv_timer))
-        del_timer_sync(&carp->adv_timer);
+    tasklet_kill(&carp->owner);
+    tasklet_hrtimer_cancel(&carp->md_timer);
+    tasklet_kill(&carp->owner);
+    carp_port_cancel_adv(carp);
 }
 
 static void carp_send_arp(struct carp *carp)
@@ -188,7 +216,7 @@ static void carp_send_arp(struct carp *carp)
 
     for (ifa = in_dev->ifa_list; ifa; ifa = ifa->ifa_next) {
         skb = arp_create(ARPOP_REQUEST, ETH_P_ARP, ifa->ifa_address, carp->odev,
-                         ifa->ifa_address, NULL, carp->odev->dev_addr, carp->dev->dev_addr);
+                         ifa->ifa_address, NULL, carp->dev->dev_addr, carp->dev->dev_addr);
         if (!skb) {
             pr_err("%s: ARP packet allocation failed\n", carp->name);
             continue;
@@ -199,10 +227,12 @@ static void carp_send_arp(struct carp *carp)
     rcu_read_unlock();
 }
 
+/* Must be called under RTNL */
 int carp_set_interface(struct carp *carp, char *dev_name)
 {
-    struct net_device *real_dev;
+    struct net_device *real_dev, *old_dev;
     struct in_device *in_dev;
+    int err;
 
     if (carp->dev == NULL)
         return 1;
@@ -210,19 +240,52 @@ int carp_set_interface(struct carp *carp, char *dev_name)
     real_dev = dev_get_by_name(dev_net(carp->dev), dev_name);
     if (real_dev) {
         pr_info("%s: Setting carpdev to %s", carp->dev->name, real_dev->name);
+        old_dev = carp->odev;
+        carp_port_detach(carp);
         carp->odev = real_dev;
-        carp->link = real_dev->ifindex;
+        err = carp_port_attach(carp);
+        if (err) {
+            pr_err("%s: unable to bind vhid %d to %s: %d\n", carp->dev->name,
+                   carp->vhid, real_dev->name, err);
+            carp->odev = old_dev;
+            if (old_dev && carp_port_attach(carp) == 0) {
+                /* the detach dropped any pending advertisement */
+                spin_lock_bh(&carp->lock);
+                carp_set_run(carp, 0);
+                spin_unlock_bh(&carp->lock);
+            }
+            dev_put(real_dev);
+            return 1;
+        }
+        if (old_dev) {
+            /* transmits still using the old carpdev are done after this */
+            synchronize_net();
+            dev_put(old_dev);
+        }
+        carp_node_rebind(carp);
+        carp->cold->link = real_dev->ifindex;
         in_dev     = in_dev_get(real_dev);
         if (in_dev != NULL && in_dev->ifa_list != NULL) {
-            carp->iph.saddr = in_dev->ifa_list[0].ifa_address;
+            carp->cold->iph.saddr = in_dev->ifa_list[0].ifa_address;
         }
 
         carp->dev->hard_header_len = real_dev->hard_header_len;
+        carp->dev->needed_headroom = real_dev->needed_headroom;
         carp->dev->mtu = real_dev->mtu;
+        carp_dev_inherit(carp, true);
+
+        if (netif_carrier_ok(real_dev))
+            netif_carrier_on(carp->dev);
+        else
+            netif_carrier_off(carp->dev);
 
-        carp->odev->flags |= IFF_BROADCAST | IFF_ALLMULTI;
-        carp->oflags = carp->odev->flags;
+        if (carp_proto_build_adv(carp))
+            pr_err("%s: failed to build advertisement\n", carp->name);
 
+        /* a master goes on advertising on the new carpdev */
+        spin_lock_bh(&carp->lock);
+        carp_set_run(carp, 0);
+        spin_unlock_bh(&carp->lock);
     } else {
         return 1;
     }
@@ -230,6 +293,43 @@ int carp_set_interface(struct carp *carp, char *dev_name)
     return 0;
 }
 
+/*
+ * Move the carp to the carpdev tdev with the given vhid, taking over the
+ * reference on tdev. On failure the carp is left bound as it was and the
+ * caller keeps its reference. Must be called under RTNL.
+ */
+static int carp_switch_odev(struct carp *carp, struct net_device *tdev, u8 vhid)
+{
+    struct net_device *old_dev = carp->odev;
+    u8 old_vhid = carp->vhid;
+    int err;
+
+    carp_port_detach(carp);
+    carp->odev = tdev;
+    carp->vhid = vhid;
+    err = carp_port_attach(carp);
+    if (err) {
+        pr_err("%s: unable to bind vhid %d to %s\n", carp->dev->name,
+               vhid, tdev->name);
+        carp->odev = old_dev;
+        carp->vhid = old_vhid;
+        if (old_dev)
+            carp_port_attach(carp);
+        return err;
+    }
+
+    if (old_dev) {
+        /* transmits still using the old carpdev are done after this */
+        synchronize_net();
+        dev_put(old_dev);
+    }
+
+    carp->cold->link = tdev->ifindex;
+    carp_dev_inherit(carp, true);
+    carp_node_rebind(carp);
+    return 0;
+}
+
 void carp_set_run(struct carp *carp, sa_family_t af)
 {
     if (carp->odev == NULL) {
@@ -251,13 +351,13 @@ void carp_set_run(struct carp *carp, sa_family_t af)
             carp_set_run(carp, 0);
             break;
         case BACKUP:
-            if (timer_pending(&carp->adv_timer))
-                del_timer_sync(&carp->adv_timer);
-            mod_timer(&carp->md_timer, jiffies + carp->md_timeout);
+            carp_port_cancel_adv(carp);
+            tasklet_hrtimer_start(&carp->md_timer, carp->md_timeout,
+                                  HRTIMER_MODE_REL);
             break;
         case MASTER:
-    		if (!timer_pending(&carp->adv_timer))
-    			mod_timer(&carp->adv_timer, jiffies + carp->adv_timeout);
+    		if (!carp_adv_pending(carp))
+    			carp_port_schedule_adv(carp, carp->adv_timeout);
             break;
     }
 }
@@ -274,18 +374,20 @@ void carp_set_state(struct carp *carp, enum carp_state state)
             carp_states[carp->state], carp_states[state]);
 
     carp->state = state;
+    carp->state_changed = ktime_get();
 
     // TODO: set the link state of the carpX interface
     switch (state) {
     	case MASTER:
     		carp_call_queue(MASTER_QUEUE);
-    		if (!timer_pending(&carp->adv_timer))
-    			mod_timer(&carp->adv_timer, jiffies + carp->adv_timeout);
+    		if (!carp_adv_pending(carp))
+    			carp_port_schedule_adv(carp, carp->adv_timeout);
     		break;
     	case BACKUP:
     		carp_call_queue(BACKUP_QUEUE);
-    		if (!timer_pending(&carp->md_timer))
-    			mod_timer(&carp->md_timer, jiffies + carp->md_timeout);
+    		if (!hrtimer_active(&carp->md_timer.timer))
+    			tasklet_hrtimer_start(&carp->md_timer, carp->md_timeout,
+    			                      HRTIMER_MODE_REL);
     		break;
     	default:
     		break;
@@ -308,47 +410,172 @@ void carp_master_down(unsigned long data)
             carp_proto_adv(carp);
             //if (carp->balancing == CARP_BAL_NONE) {
                 carp_send_arp(carp);
-                carp->carp_delayed_arp = 2;
+                carp->cold->carp_delayed_arp = 2;
             //}
             carp_set_run(carp, 0);
             break;
     }
 }
 
-static int carp_dev_xmit(struct sk_buff *skb, struct net_device *carp_dev)
+static enum hrtimer_restart carp_md_timer_fn(struct hrtimer *timer)
 {
-    carp_dbg("%s\n", __func__);
-#if 0
-    struct carp *cp = netdev_priv(dev);
-    struct net_device_stats *stats = &cp->stat;
-    struct iphdr  *iph = skb->nh.iph;
-    u8     tos;
-    u16    df;
-    struct rtable *rt;
-    struct net_device *tdev;
-    u32    dst;
-    int    mtu;
-    int err;
-    int pkt_len = skb->len;
-    log("%s\n", __func__);
-
-    skb->ip_summed = CHECKSUM_NONE;
-    skb->protocol = htons(ETH_P_IP);
-
-    ip_select_ident(iph, &rt->u.dst, NULL);
-    ip_send_check(iph);
-    err = NF_HOOK(PF_INET, NF_IP_LOCAL_OUT, skb, NULL, rt->u.dst.dev, dst_output);
-    if (err == NET_XMIT_SUCCESS || err == NET_XMIT_CN) {
-    	stats->tx_bytes += pkt_len;
-    	stats->tx_packets++;
-    } else {
-    	stats->tx_errors++;
-    	stats->tx_aborted_errors++;
+    struct carp *carp = container_of(timer, struct carp, md_timer.timer);
+    s64 silent_ms;
+
+    if (carp->state == BACKUP && carp->md_bound_ms &&
+        ktime_to_ns(carp->last_rx)) {
+        silent_ms = ktime_to_ms(ktime_sub(ktime_get(), carp->last_rx));
+        if (silent_ms > carp->md_bound_ms)
+            carp->cstat.md_overruns++;
     }
-#endif
+
+    set_bit(CARP_MASTER_DOWN, &carp->events);
+    tasklet_schedule(&carp->owner);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Set the advertisement interval and recompute the timeouts. Fails with
+ * -ERANGE if the resulting master down time would exceed md_bound_ms.
+ */
+int carp_set_intervals(struct carp *carp, u8 advbase, u8 advskew, u32 adv_msec)
+{
+    ktime_t md_timeout;
+
+    md_timeout = carp_calculate_timeout(3, advbase, advskew, adv_msec);
+    if (carp->md_bound_ms && ktime_to_ms(md_timeout) > carp->md_bound_ms)
+        return -ERANGE;
+
+    carp->advbase     = advbase;
+    carp->advskew     = advskew;
+    carp->adv_msec    = adv_msec;
+    carp->md_timeout  = md_timeout;
+    carp->adv_timeout = carp_calculate_timeout(1, advbase, advskew, adv_msec);
     return 0;
 }
 
+/*
+ * Take over the offloads and the TX queue count of the carpdev, so that
+ * traffic through the carp interface is segmented and checksummed by the
+ * NIC rather than in software. Called whenever the carpdev or its features
+ * change, under RTNL. A newly bound carpdev also sets the offloads that are
+ * wanted, as macvlan does at init; the carpdev is normally bound after
+ * registration, so this goes through wanted_features rather than features.
+ * Later changes below are only followed by carp_dev_fix_features(), which
+ * leaves what was set with ethtool alone.
+ */
+void carp_dev_inherit(struct carp *carp, bool bind)
+{
+    struct net_device *dev = carp->dev, *odev = carp->odev;
+    unsigned int txqs;
+
+    ASSERT_RTNL();
+
+    if (odev == NULL)
+        return;
+
+    dev->hw_features   = CARP_FEATURES;
+    dev->vlan_features = odev->vlan_features & CARP_FEATURES;
+    netif_set_gso_max_size(dev, odev->gso_max_size);
+    dev->gso_max_segs  = odev->gso_max_segs;
+
+    if (bind)
+        dev->wanted_features = (dev->wanted_features & ~CARP_FEATURES) |
+                               (odev->features & CARP_FEATURES);
+
+    /*
+     * As many queues as the carpdev. Frames are not tied to a queue below,
+     * dev_queue_xmit() on the carpdev picks its own.
+     */
+    txqs = clamp_t(unsigned int, odev->real_num_tx_queues, 1,
+                   dev->num_tx_queues);
+    if (netif_set_real_num_tx_queues(dev, txqs))
+        pr_warn("%s: unable to use %u tx queues\n", carp->name, txqs);
+
+    netdev_update_features(dev);
+}
+
+static netdev_features_t carp_dev_fix_features(struct net_device *carp_dev,
+                                               netdev_features_t features)
+{
+    struct carp *carp = netdev_priv(carp_dev);
+
+    if (carp->odev)
+        features &= carp->odev->features | ~CARP_FEATURES;
+    else
+        features &= ~CARP_FEATURES;
+
+    return features | NETIF_F_LLTX;
+}
+
+/* Whether the interface is master of its own vhid or of any of its nodes */
+bool carp_dev_master(struct carp *carp)
+{
+    struct carp *node;
+    bool master = false;
+
+    if (carp->state == MASTER)
+        return true;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(node, &carp->cold->nodes, node_entry) {
+        if (node->state == MASTER) {
+            master = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return master;
+}
+
+/*
+ * Traffic routed out of the carp interface leaves through the carpdev
+ * with the virtual MAC as its source. Frames built by the stack already
+ * carry it, so the skb is normally forwarded as is. The path takes no lock
+ * of its own (NETIF_F_LLTX) and counts per CPU. A backup must not send
+ * from the virtual addresses, so frames are dropped unless a vhid of the
+ * interface is master.
+ */
+static netdev_tx_t carp_dev_xmit(struct sk_buff *skb, struct net_device *carp_dev)
+{
+    struct carp *carp = netdev_priv(carp_dev);
+    struct carp_pcpu_stats *stats = this_cpu_ptr(carp->pcpu_stats);
+    struct net_device *odev = ACCESS_ONCE(carp->odev);
+    struct ethhdr *eth;
+    unsigned int len = skb->len;
+
+    if (unlikely(odev == NULL || !carp_dev_master(carp)))
+        goto drop;
+
+    if (unlikely(!pskb_may_pull(skb, ETH_HLEN)))
+        goto drop;
+
+    eth = (struct ethhdr *)skb->data;
+    if (unlikely(!ether_addr_equal(eth->h_source, carp_dev->dev_addr))) {
+        if (skb_cow_head(skb, 0))
+            goto drop;
+        eth = (struct ethhdr *)skb->data;
+        memcpy(eth->h_source, carp_dev->dev_addr, ETH_ALEN);
+    }
+
+    skb->dev = odev;
+    if (likely(net_xmit_eval(dev_queue_xmit(skb)) == 0)) {
+        u64_stats_update_begin(&stats->syncp);
+        stats->tx_packets++;
+        stats->tx_bytes += len;
+        u64_stats_update_end(&stats->syncp);
+    } else {
+        stats->tx_dropped++;
+    }
+    return NETDEV_TX_OK;
+
+drop:
+    stats->tx_dropped++;
+    kfree_skb(skb);
+    return NETDEV_TX_OK;
+}
+
 static int carp_dev_ioctl (struct net_device *carp_dev, struct ifreq *ifr, int cmd)
 {
     int err = 0;
@@ -357,7 +584,6 @@ static int carp_dev_ioctl (struct net_device *carp_dev, struct ifreq *ifr, int c
 
     struct net_device *tdev = NULL;
     struct carp_ioctl_params p;
-    struct timeval tv;
 
     carp_dbg("%s\n", __func__);
 
@@ -380,46 +606,54 @@ static int carp_dev_ioctl (struct net_device *carp_dev, struct ifreq *ifr, int c
 
     		carp_dbg("Setting new CARP parameters.\n");
 
-    		if (memcmp(p.devname, carp->odev->name, IFNAMSIZ) && (tdev = dev_get_by_name(dev_net(carp_dev), p.devname)) != NULL)
+    		if ((!carp->odev || memcmp(p.devname, carp->odev->name, IFNAMSIZ)) &&
+    		    (tdev = dev_get_by_name(dev_net(carp_dev), p.devname)) != NULL)
+    		{
+    			/* nothing is touched unless the vhid is free there */
+    			if (!carp_port_vhid_free(carp, tdev, p.carp_vhid)) {
+    				dev_put(tdev);
+    				err = -EEXIST;
+    				goto err_out;
+    			}
+
     			carp_dev_close(carp->dev);
+    			err = carp_switch_odev(carp, tdev, p.carp_vhid);
+    			if (err) {
+    				dev_put(tdev);
+    				goto err_reopen;
+    			}
+    		} else {
+    			/* The vhid table is updated under RTNL, outside of carp->lock */
+    			err = carp_port_set_vhid(carp, p.carp_vhid);
+    			if (err)
+    				goto err_out;
+    		}
+    		carp_set_vmac(carp);
+
+    		err = carp_set_intervals(carp, p.carp_advbase, p.carp_advskew,
+    		                         carp->adv_msec);
+    		if (err)
+    			goto err_reopen;
+    		carp_node_sync(carp);
+
+    		/* Rekey once here rather than on every advertisement */
+    		if (memcmp(p.carp_key, carp->cold->carp_key, sizeof(carp->cold->carp_key))) {
+    			err = carp_crypto_setkey(carp, p.carp_key);
+    			if (err)
+    				goto err_reopen;
+    		}
 
+    		spin_lock_bh(&carp->lock);
 
-    		spin_lock(&carp->lock);
+    		carp_set_state(carp, p.state);
+    		memcpy(carp->cold->carp_pad, p.carp_pad, sizeof(carp->cold->carp_pad));
 
-    		if (tdev)
-    		{
-    			carp->odev->flags = carp->oflags;
-    			dev_put(carp->odev);
+    		spin_unlock_bh(&carp->lock);
 
-    			carp->odev 	= tdev;
-    			carp->link 	= carp->odev->ifindex;
-    			carp->oflags 	= carp->odev->flags;
-    			carp->odev->flags |= IFF_BROADCAST | IFF_ALLMULTI;
-    		}
+    		err = carp_proto_build_adv(carp);
+    		if (err)
+    			goto err_reopen;
 
-    		carp_set_state(carp, p.state);
-    		memcpy(carp->carp_pad, p.carp_pad, sizeof(carp->carp_pad));
-    		memcpy(carp->carp_key, p.carp_key, sizeof(carp->carp_key));
-    		carp->vhid = p.carp_vhid;
-    		carp->advbase = p.carp_advbase;
-    		carp->advskew = p.carp_advskew;
-
-            tv.tv_sec = 3 * carp->advbase;
-            if (carp->advbase == 0 && carp->advskew == 0)
-                tv.tv_usec = 3 * 1000000 / 256;
-            else
-                tv.tv_usec = carp->advskew * 1000000 / 256;
-            carp->md_timeout  = timeval_to_jiffies(&tv);
-
-            tv.tv_sec = carp->advbase;
-            if (carp->advbase == 0 && carp->advskew == 0)
-                tv.tv_usec = 1 * 1000000 / 256;
-            else
-                tv.tv_usec = carp->advskew * 1000000 / 256;
-            carp->adv_timeout = timeval_to_jiffies(&tv);
-
-
-    		spin_unlock(&carp->lock);
     		if (tdev)
     			carp_dev_open(carp->dev);
     		break;
@@ -427,18 +661,20 @@ static int carp_dev_ioctl (struct net_device *carp_dev, struct ifreq *ifr, int c
 
     		carp_dbg("Dumping CARP parameters.\n");
 
-    		spin_lock(&carp->lock);
+    		spin_lock_bh(&carp->lock);
     		p.state = carp->state;
-    		memcpy(p.carp_pad, carp->carp_pad, sizeof(carp->carp_pad));
-    		memcpy(p.carp_key, carp->carp_key, sizeof(carp->carp_key));
+    		memcpy(p.carp_pad, carp->cold->carp_pad, sizeof(carp->cold->carp_pad));
+    		memcpy(p.carp_key, carp->cold->carp_key, sizeof(carp->cold->carp_key));
     		p.carp_vhid = carp->vhid;
     		p.carp_advbase = carp->advbase;
     		p.carp_advskew = carp->advskew;
-    		p.md_timeout = carp->md_timeout;
-    		p.adv_timeout = carp->adv_timeout;
-    		memcpy(p.devname, carp->odev->name, sizeof(p.devname));
+    		p.md_timeout = ktime_to_ms(carp->md_timeout);
+    		p.adv_timeout = ktime_to_ms(carp->adv_timeout);
+    		/* left empty while no carpdev is bound */
+    		if (carp->odev)
+    			memcpy(p.devname, carp->odev->name, sizeof(p.devname));
     		p.devname[sizeof(p.devname) - 1] = '\0';
-    		spin_unlock(&carp->lock);
+    		spin_unlock_bh(&carp->lock);
 
     		err = -EFAULT;
     		if (copy_to_user(ifr->ifr_ifru.ifru_data, &p, sizeof(p)))
@@ -453,16 +689,52 @@ static int carp_dev_ioctl (struct net_device *carp_dev, struct ifreq *ifr, int c
 
 err_out:
     return err;
+
+err_reopen:
+    /* a failure past the carpdev switch must not leave the carp closed */
+    if (tdev)
+    	carp_dev_open(carp->dev);
+    return err;
 }
 
-static struct net_device_stats *carp_dev_get_stats(struct net_device *carp_dev)
+static struct rtnl_link_stats64 *carp_dev_get_stats64(struct net_device *carp_dev,
+                                                      struct rtnl_link_stats64 *tot)
 {
     struct carp *carp = netdev_priv(carp_dev);
-    return &(carp->stat);
+    struct carp_pcpu_stats *stats;
+    u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+    unsigned int start;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(carp->pcpu_stats, cpu);
+        do {
+            start      = u64_stats_fetch_begin_bh(&stats->syncp);
+            rx_packets = stats->rx_packets;
+            rx_bytes   = stats->rx_bytes;
+            tx_packets = stats->tx_packets;
+            tx_bytes   = stats->tx_bytes;
+        } while (u64_stats_fetch_retry_bh(&stats->syncp, start));
+
+        tot->rx_packets += rx_packets;
+        tot->rx_bytes   += rx_bytes;
+        tot->tx_packets += tx_packets;
+        tot->tx_bytes   += tx_bytes;
+        /* u32, updated without the syncp */
+        tot->rx_dropped += stats->rx_dropped;
+        tot->tx_dropped += stats->tx_dropped;
+    }
+
+    return tot;
 }
 
 static int carp_dev_change_mtu(struct net_device *carp_dev, int new_mtu)
 {
+    struct carp *carp = netdev_priv(carp_dev);
+
+    if (new_mtu < 68 || (carp->odev && new_mtu > carp->odev->mtu))
+        return -EINVAL;
+
     carp_dev->mtu = new_mtu;
     return 0;
 }
@@ -475,8 +747,9 @@ static int carp_set_mac_address(struct net_device *carp_dev, void *addr)
     if (!is_valid_ether_addr(address->sa_data))
         return -EADDRNOTAVAIL;
 
-    memcpy(carp_dev->dev_addr, address->sa_data, carp_dev->addr_len);
-    memcpy(carp->hwaddr, address->sa_data, carp_dev->addr_len);
+    memcpy(carp_dev->dev_addr, address->sa_data, ETH_ALEN);
+    memcpy(carp->cold->hwaddr, address->sa_data, ETH_ALEN);
+    carp_port_sync_filter(carp);
     return 0;
 }
 
@@ -488,14 +761,86 @@ static const struct net_device_ops carp_netdev_ops = {
     .ndo_do_ioctl        = carp_dev_ioctl,
     .ndo_change_mtu      = carp_dev_change_mtu,
     .ndo_start_xmit      = carp_dev_xmit,
-    .ndo_get_stats       = carp_dev_get_stats,
+    .ndo_fix_features    = carp_dev_fix_features,
+    .ndo_get_stats64     = carp_dev_get_stats64,
+    .ndo_validate_addr   = eth_validate_addr,
 // NOTE: the below were never implemented in the old carp module
-//    .ndo_validate_addr   = eth_validate_addr,
 //    .ndo_set_rx_mode     = set_multicast_list,
     .ndo_set_mac_address = carp_set_mac_address,
-//    .ndo_get_stats64     = carp_get_stats64,
 };
 
+/*
+ * Unless one was set explicitly, the virtual MAC of a carp interface is
+ * 00:00:5e:00:01:<vhid>, as in VRRP and OpenBSD's carp. Called when the
+ * vhid changes, under RTNL.
+ */
+void carp_set_vmac(struct carp *carp)
+{
+    u8 addr[ETH_ALEN] = { 0x00, 0x00, 0x5e, 0x00, 0x01, carp->vhid };
+
+    if (!is_zero_ether_addr(carp->cold->hwaddr) ||
+        ether_addr_equal(carp->dev->dev_addr, addr))
+        return;
+
+    memcpy(carp->dev->dev_addr, addr, ETH_ALEN);
+    carp_port_sync_filter(carp);
+    if (carp->dev->reg_state == NETREG_REGISTERED)
+        call_netdevice_notifiers(NETDEV_CHANGEADDR, carp->dev);
+}
+
+/*
+ * Initialise the timers, locks and counters of a carp or carp node.
+ * The rate limit starts out at its defaults.
+ */
+void carp_init_state(struct carp *carp)
+{
+    /* Setup the carp advertisements */
+    get_random_bytes(&carp->carp_adv_counter, 8);
+    get_random_bytes(&carp->bundle_counter, 8);
+
+    tasklet_hrtimer_init(&carp->md_timer, carp_md_timer_fn,
+                         CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+
+    INIT_LIST_HEAD(&carp->adv_entry);
+
+    spin_lock_init(&carp->lock);
+    spin_lock_init(&carp->adv_lock);
+    tasklet_init(&carp->owner, carp_proto_owner, (unsigned long)carp);
+
+    carp->rx_rate  = CARP_RL_DEFAULT_RATE;
+    carp->rx_burst = CARP_RL_DEFAULT_BURST;
+}
+
+static void carp_dev_free(struct net_device *carp_dev)
+{
+    struct carp *carp = netdev_priv(carp_dev);
+
+    free_percpu(carp->pcpu_stats);
+    kfree(carp->cold);
+    free_netdev(carp_dev);
+}
+
+/* Allocate the cold section with its defaults */
+static int carp_dev_alloc_cold(struct carp *carp)
+{
+    struct carp_cold *cold;
+
+    cold = kzalloc(sizeof(struct carp_cold), GFP_KERNEL);
+    if (cold == NULL)
+        return -ENOMEM;
+
+    cold->iph.saddr = addr2val(10, 0, 0, 3);
+    cold->iph.daddr = MULTICAST_ADDR;
+    cold->iph.tos   = 0;
+
+    memset(cold->carp_key, 1, sizeof(cold->carp_key));
+    INIT_LIST_HEAD(&cold->nodes);
+    INIT_LIST_HEAD(&cold->peers);
+
+    carp->cold = cold;
+    return 0;
+}
+
 static void carp_dev_setup(struct net_device *carp_dev)
 {
     int res;
@@ -506,72 +851,62 @@ static void carp_dev_setup(struct net_device *carp_dev)
     /* Initialise the device entry points */
     carp_dev->netdev_ops = &carp_netdev_ops;
 
-    carp_dev->destructor = free_netdev;
+    carp_dev->destructor = carp_dev_free;
 
     // FIXME: what happened to the owner field?
     //carp_dev->owner = THIS_MODULE;
-    carp_dev->type            = ARPHRD_ETHER;
-    carp_dev->hard_header_len = LL_MAX_HEADER;
-    carp_dev->mtu             = 1500;
-    carp_dev->flags           = IFF_NOARP;
+    /* an Ethernet device of its own, with the virtual MAC as address */
+    ether_setup(carp_dev);
+    carp_dev->tx_queue_len    = 0;
+    carp_dev->features       |= NETIF_F_LLTX;
+    carp_dev->hw_features     = CARP_FEATURES;
+    carp_dev->priv_flags     &= ~IFF_TX_SKB_SHARING;
     carp_dev->iflink          = 0;
-    carp_dev->addr_len        = 4;
 
     /* Initialise carp options */
-    carp->iph.saddr = addr2val(10, 0, 0, 3);
-    carp->iph.daddr = MULTICAST_ADDR;
-    carp->iph.tos   = 0;
-
     carp->state     = INIT;
     carp->vhid      = 0;
-    carp->advskew   = 0;
-    carp->advbase   = CARP_DFLTINTV;
     carp->version   = CARP_VERSION;
+    carp_set_intervals(carp, CARP_DFLTINTV, 0, 0);
 
-    /* Setup the carp advertisements */
-    memset(carp->carp_key, 1, sizeof(carp->carp_key));
-    get_random_bytes(&carp->carp_adv_counter, 8);
-
-    carp->md_timeout  = carp_calculate_timeout(3, carp->advbase, carp->advskew);
-    carp->adv_timeout = carp_calculate_timeout(1, carp->advbase, carp->advskew);
-
-    init_timer(&carp->md_timer);
-    carp->md_timer.data      = (unsigned long)carp;
-    carp->md_timer.function  = carp_master_down;
-
-    init_timer(&carp->adv_timer);
-    carp->adv_timer.data     = (unsigned long)carp;
-    carp->adv_timer.function = carp_advertise;
-
-    carp->hash = crypto_alloc_hash("hmac(sha1)", 0, CRYPTO_ALG_ASYNC);
-    if (!carp->hash) {
-        pr_err("Failed to allocate SHA1 hash.\n");
-        res = -EINVAL;
-        goto out;
-    }
+    carp_init_state(carp);
 
     res = carp_init_queues();
     if (res)
-        goto err_out_crypto_free;
+        goto out;
 
     return;
 
-err_out_crypto_free:
-    crypto_free_hash(carp->hash);
 out:
     return;
 }
 
+/*
+ * Stop taking part in the elections of the interface and its nodes,
+ * announcing it to the peers with a bow-out advertisement. Under RTNL.
+ */
+static void carp_dev_resign(struct carp *carp)
+{
+    carp_del_all_timeouts(carp);
+
+    carp->carp_bow_out = 1;
+    carp_proto_adv(carp);
+    carp->carp_bow_out = 0;
+
+    carp_set_state(carp, INIT);
+    carp_node_close(carp);
+}
+
 /* Called when the link state is set to UP */
 static int carp_dev_open(struct net_device *carp_dev)
 {
     struct carp *carp = netdev_priv(carp_dev);
     struct rtable *rt;
     struct flowi4 fl4 = {
-        .flowi4_oif   = carp->link,
-        .daddr        = carp->iph.daddr,
-        .saddr        = carp->iph.saddr,
-        .flowi4_tos   = RT_TOS(carp->iph.tos),
+        .flowi4_oif   = carp->cold->link,
+        .daddr        = carp->cold->iph.daddr,
+        .saddr        = carp->cold->iph.saddr,
+        .flowi4_tos   = RT_TOS(carp->cold->iph.tos),
         .flowi4_proto = IPPROTO_CARP,
     };
     carp_dbg("%s", __func__);
@@ -587,11 +922,12 @@ static int carp_dev_open(struct net_device *carp_dev)
     ip_rt_put(rt);
     if (in_dev_get(carp_dev) == NULL)
     	return -EADDRNOTAVAIL;
-    carp->mlink = carp_dev->ifindex;
-    ip_mc_inc_group(in_dev_get(carp_dev), carp->iph.daddr);
+    carp->cold->mlink = carp_dev->ifindex;
+    ip_mc_inc_group(in_dev_get(carp_dev), carp->cold->iph.daddr);
 
     carp->dev->flags |= IFF_UP;
     carp_set_run(carp, 0);
+    carp_node_open(carp);
 
     return 0;
 }
@@ -600,20 +936,14 @@ static int carp_dev_open(struct net_device *carp_dev)
 static int carp_dev_close(struct net_device *carp_dev)
 {
     struct carp *carp = netdev_priv(carp_dev);
-    struct in_device *in_dev = inetdev_by_index(dev_net(carp_dev), carp->mlink);
+    struct in_device *in_dev = inetdev_by_index(dev_net(carp_dev), carp->cold->mlink);
 
     if (in_dev) {
-    	ip_mc_dec_group(in_dev, carp->iph.daddr);
+    	ip_mc_dec_group(in_dev, carp->cold->iph.daddr);
     	in_dev_put(in_dev);
     }
 
-    carp_del_all_timeouts(carp);
-
-    carp->carp_bow_out = 1;
-    carp_proto_adv(carp);
-    carp->carp_bow_out = 0;
-
-    carp_set_state(carp, INIT);
+    carp_dev_resign(carp);
 
     return 0;
 }
@@ -625,29 +955,62 @@ static int carp_dev_init(struct net_device *carp_dev)
 {
     struct carp *carp;
     struct iphdr *iph;
+    int res;
     carp_dbg("%s\n", __func__);
 
     carp = netdev_priv(carp_dev);
-    iph = &carp->iph;
 
+    res = carp_dev_alloc_cold(carp);
+    if (res)
+        return res;
+
+    res = -ENOMEM;
+    carp->pcpu_stats = alloc_percpu(struct carp_pcpu_stats);
+    if (carp->pcpu_stats == NULL)
+        goto err_free_cold;
+
+    iph = &carp->cold->iph;
+
+    res = -EINVAL;
     if (!iph->daddr || !MULTICAST(iph->daddr) || !iph->saddr)
-    	return -EINVAL;
+    	goto err_free_cold;
 
-    dev_hold(carp_dev);
+    res = carp_crypto_setkey(carp, carp->cold->carp_key);
+    if (res)
+        goto err_free_cold;
+
+    res = carp_proto_sig_init(carp);
+    if (res)
+        goto err_free_crypto;
 
-    ip_eth_mc_map(carp->iph.daddr, carp_dev->dev_addr);
-    memcpy(carp_dev->broadcast, &iph->daddr, 4);
+    dev_hold(carp_dev);
 
     carp_dev->netdev_ops = &carp_netdev_ops;
 
     carp->dev = carp_dev;
     strncpy(carp->name, carp_dev->name, IFNAMSIZ);
 
+    /* an address given at creation is kept, otherwise it follows the vhid */
+    if (is_valid_ether_addr(carp_dev->dev_addr))
+        memcpy(carp->cold->hwaddr, carp_dev->dev_addr, ETH_ALEN);
+    else
+        carp_set_vmac(carp);
+
     carp_create_proc_entry(carp);
+    carp_debug_register(carp);
     carp_prepare_sysfs_group(carp);
     list_add_tail(&carp->carp_list, &cn_global->dev_list);
 
     return 0;
+
+err_free_crypto:
+    carp_crypto_free(carp);
+err_free_cold:
+    free_percpu(carp->pcpu_stats);
+    carp->pcpu_stats = NULL;
+    kfree(carp->cold);
+    carp->cold = NULL;
+    return res;
 }
 
 static int carp_validate(struct nlattr *tb[], struct nlattr *data[])
@@ -667,6 +1030,10 @@ static int carp_get_tx_queues(struct net *net, struct nlattr *tb[],
                               unsigned int *real_num_queues)
 {
     carp_dbg("%s", __func__);
+
+    /* sized to the carpdev once one is set */
+    *num_queues      = carp_tx_queues;
+    *real_num_queues = 1;
     return 0;
 }
 
@@ -715,6 +1082,11 @@ static int __net_init carp_net_init(struct net *net)
 
     cn->net = net;
     INIT_LIST_HEAD(&cn->dev_list);
+    carp_port_init_net(cn);
+
+    cn->stat = alloc_percpu(struct carp_net_stat);
+    if (cn->stat == NULL)
+        return -ENOMEM;
 
     cn_global = cn;
 
@@ -731,6 +1103,7 @@ static void __net_exit carp_net_exit(struct net *net)
 
     //carp_destroy_sysfs(cn);
     carp_destroy_proc_dir(cn);
+    free_percpu(cn->stat);
 }
 
 static struct pernet_operations carp_net_ops = {
@@ -740,6 +1113,161 @@ static struct pernet_operations carp_net_ops = {
     .size = sizeof(struct carp_net),
 };
 
+/*
+ * The carpdev lost its link or went down: resign at once instead of
+ * leaving the peers to wait for the master down timer, and stop claiming
+ * the virtual addresses.
+ */
+static void carp_odev_down(struct carp *carp)
+{
+    struct carp *node;
+    bool active = carp->state != INIT;
+
+    netif_carrier_off(carp->dev);
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry)
+        active |= node->state != INIT;
+
+    if (active)
+        carp_dev_resign(carp);
+}
+
+/* The carpdev has its link back: rejoin as backup */
+static void carp_odev_up(struct carp *carp)
+{
+    netif_carrier_on(carp->dev);
+    if (!(carp->dev->flags & IFF_UP))
+        return;
+
+    if (carp->state == INIT)
+        carp_set_run(carp, 0);
+    carp_node_open(carp);
+}
+
+/*
+ * The carpdev is going away: leave the carp unbound. The caller releases
+ * the carp's reference on the carpdev after a grace period.
+ */
+static void carp_odev_unregister(struct carp *carp)
+{
+    struct net_device *odev = carp->odev;
+
+    pr_info("%s: carpdev %s unregistered\n", carp->name, odev->name);
+
+    carp_odev_down(carp);
+    carp_port_detach(carp);
+    carp_proto_free_adv(carp);
+
+    carp->odev = NULL;
+    carp->cold->link = 0;
+    carp_node_rebind(carp);
+    carp_set_run(carp, 0);
+}
+
+/*
+ * Follow changes of the carpdevs. The carp interfaces using a device are
+ * found by walking the devices of its namespace, which only happens on
+ * these rare events.
+ */
+static int carp_netdev_event(struct notifier_block *this,
+                             unsigned long event, void *ptr)
+{
+    struct net_device *dev = ptr, *carp_dev;
+    struct carp *carp;
+    int released = 0;
+
+    if (dev->netdev_ops == &carp_netdev_ops)
+        return NOTIFY_DONE;
+
+    switch (event) {
+        case NETDEV_FEAT_CHANGE:
+        case NETDEV_DOWN:
+        case NETDEV_UP:
+        case NETDEV_CHANGE:
+        case NETDEV_CHANGEADDR:
+        case NETDEV_CHANGEMTU:
+        case NETDEV_UNREGISTER:
+            break;
+        default:
+            return NOTIFY_DONE;
+    }
+
+    for_each_netdev(dev_net(dev), carp_dev) {
+        if (carp_dev->netdev_ops != &carp_netdev_ops)
+            continue;
+
+        carp = netdev_priv(carp_dev);
+        if (carp->odev != dev)
+            continue;
+
+        switch (event) {
+            case NETDEV_FEAT_CHANGE:
+                carp_dev_inherit(carp, false);
+                break;
+            case NETDEV_DOWN:
+                carp_odev_down(carp);
+                break;
+            case NETDEV_UP:
+            case NETDEV_CHANGE:
+                if (netif_running(dev) && netif_carrier_ok(dev))
+                    carp_odev_up(carp);
+                else
+                    carp_odev_down(carp);
+                break;
+            case NETDEV_CHANGEADDR:
+                /* the templates carry the carpdev's MAC */
+                if (carp_proto_build_adv(carp))
+                    pr_err("%s: failed to build advertisement\n", carp->name);
+                carp_node_sync(carp);
+                break;
+            case NETDEV_CHANGEMTU:
+                if (carp_dev->mtu > dev->mtu)
+                    dev_set_mtu(carp_dev, dev->mtu);
+                break;
+            case NETDEV_UNREGISTER:
+                carp_odev_unregister(carp);
+                released++;
+                break;
+        }
+    }
+
+    /* transmits and readers still using the carpdev are done after this */
+    if (released) {
+        synchronize_net();
+        while (released--)
+            dev_put(dev);
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block carp_notifier_block __read_mostly = {
+    .notifier_call = carp_netdev_event,
+};
+
+/*
+ * The layout of struct carp described in carp.h, checked on every build.
+ * Each group starts a cacheline of its own; what a packet path touches
+ * within a group must not spill into the next line.
+ */
+static void __init carp_check_layout(void)
+{
+    /* everything the receive path reads fits in the first cacheline */
+    BUILD_BUG_ON(CARP_SPAN(dev, rx_sample) > SMP_CACHE_BYTES);
+    /* what it writes for every advertisement shares one line */
+    BUILD_BUG_ON(CARP_SPAN(rx_sample, cstat) > SMP_CACHE_BYTES);
+    /* the stats are the rest of the receive group */
+    BUILD_BUG_ON(CARP_SPAN(rx_sample, lock) > 2 * SMP_CACHE_BYTES);
+#if !defined(CONFIG_DEBUG_SPINLOCK) && !defined(CONFIG_DEBUG_LOCK_ALLOC)
+    /* the election lock and the parameters the tasklet compares */
+    BUILD_BUG_ON(CARP_SPAN(lock, owner) > SMP_CACHE_BYTES);
+    /* the transmit lock and the state of the next advertisement */
+    BUILD_BUG_ON(CARP_SPAN(adv_lock, bundle_counter) > SMP_CACHE_BYTES);
+    /* carp nodes, with their template and spare, are allocated by the thousand */
+    BUILD_BUG_ON(sizeof(struct carp) + 2 * CARP_ADV_TRUESIZE > CARP_NODE_MAX_SIZE);
+#endif
+}
+
 static int __init carp_init(void)
 {
     int i;
@@ -751,6 +1279,10 @@ static int __init carp_init(void)
     if (carp_preempt == 1)
         carp_dbg("carp: Using master pre-emption.");
 
+    carp_verify_batch = clamp(carp_verify_batch, 0, CARP_VERIFY_MAX_BATCH);
+
+    carp_check_layout();
+
     res = register_pernet_subsys(&carp_net_ops);
     if (res)
         goto out;
@@ -763,6 +1295,10 @@ static int __init carp_init(void)
     if (res)
         goto err_link;
 
+    res = register_netdevice_notifier(&carp_notifier_block);
+    if (res)
+        goto err_notifier;
+
     carp_create_debugfs();
 
     for (i = 0; i < carp_max_devices; i++) {
@@ -775,6 +1311,10 @@ out:
     return res;
 err:
     carp_dbg("carp: error creating netdev");
+    carp_destroy_debugfs();
+    unregister_netdevice_notifier(&carp_notifier_block);
+err_notifier:
+    carp_dbg("carp: error registering notifier");
     rtnl_link_unregister(&carp_link_ops);
 err_link:
     carp_dbg("carp: error registering link");
@@ -792,6 +1332,7 @@ static void __exit carp_exit(void)
     pr_info("carp: unloading");
     carp_destroy_debugfs();
 
+    unregister_netdevice_notifier(&carp_notifier_block);
     rtnl_link_unregister(&carp_link_ops);
     unregister_pernet_subsys(&carp_net_ops);
 
@@ -799,6 +1340,9 @@ static void __exit carp_exit(void)
 
     if (carp_unregister_protocol() < 0)
         pr_info("Failed to remove CARP protocol handler.\n");
+
+    /* ports are freed from RCU callbacks in this module */
+    rcu_barrier();
 }
 
 module_init(carp_init);
@@ -25,9 +25,15 @@
 #define __CARP_H
 
 #include <linux/netdevice.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/if.h>
 #include <linux/ip.h>
 #include <linux/proc_fs.h>
+#include <linux/workqueue.h>
+#include <linux/u64_stats_sync.h>
 
 #include "carp_ioctl.h"
 
@@ -41,14 +47,59 @@
 #define CARP_TTL               255
 #define	CARP_SIG_LEN            20
 #define CARP_DEFAULT_TX_QUEUES  16
+#define CARP_ADV_RETRIES         5
+#define CARP_ADV_RETRY_NS       NSEC_PER_MSEC
+#define CARP_ADV_SLACK_NS       NSEC_PER_MSEC
 #define CARP_STATE_LEN           8
 #define CARP_STATES "INIT", "MASTER", "BACKUP"
+#define CARP_MAX_VHID          256
+#define CARP_PORT_HASH_BITS      4
+#define CARP_PORT_HASH_SIZE     (1 << CARP_PORT_HASH_BITS)
+#define CARP_VMAC_HASH_BITS      4
+#define CARP_VMAC_HASH_SIZE     (1 << CARP_VMAC_HASH_BITS)
+#define CARP_RX_BENCH_LOOPS    10000
+
+/* offloads the carp interface takes over from its carpdev */
+#define CARP_FEATURES (NETIF_F_SG | NETIF_F_ALL_CSUM | NETIF_F_HIGHDMA | \
+                       NETIF_F_FRAGLIST | NETIF_F_GSO | NETIF_F_TSO | \
+                       NETIF_F_UFO | NETIF_F_GSO_ROBUST | NETIF_F_TSO_ECN | \
+                       NETIF_F_TSO6 | NETIF_F_GRO | NETIF_F_RXCSUM)
+#define CARP_RL_HASH_BITS        7
+#define CARP_RL_BUCKETS         (1 << CARP_RL_HASH_BITS)
+#define CARP_RL_WAYS             4
+#define CARP_RL_DEFAULT_RATE   200
+#define CARP_RL_DEFAULT_BURST   20
+#define CARP_VERIFY_MAX_BATCH   64
+#define CARP_AUTH_MAX_DIGEST    32
+#define CARP_AUTH_BENCH_LOOPS   100000
+#define CARP_AUTH_NAME_LEN      16
+#define CARP_SIG_RING           64
+#define CARP_SIG_BATCH          16
+#define CARP_NODE_MAX_SIZE    4096
+#define CARP_MAX_PEERS          16
 
 /* carp_version */
 #define	CARP_VERSION             2
 
 /* carp_type */
 #define CARP_ADVERTISEMENT       0x01
+#define CARP_BUNDLE              0x02
+
+/*
+ * carp_authlen; the high bits announce that the sender accepts bundles and
+ * that it runs millisecond intervals, see carp_wire_advbase()
+ */
+#define CARP_AUTHLEN             7
+#define CARP_AUTHLEN_BUNDLE      0x80
+#define CARP_AUTHLEN_MSEC        0x40
+
+/* carp->adv_msec, which has to fit carp_advbase */
+#define CARP_MAX_ADV_MSEC        255
+
+/* carp->bundle */
+#define CARP_BUNDLE_OFF          0
+#define CARP_BUNDLE_AUTO         1
+#define CARP_BUNDLE_ON           2
 
 /* carp_advbase */
 #define CARP_DFLTINTV            1
@@ -67,11 +118,14 @@ extern int carp_net_id;
 extern int carp_preempt;
 extern int carp_max_devices;
 extern int carp_tx_queues;
+extern int carp_verify_batch;
+extern int carp_prefilter;
 
 /*
- * carp->flags definitions.
+ * carp->events bits.
  */
-#define CARP_DATA_AVAIL		(1<<0)
+#define CARP_DATA_AVAIL		0
+#define CARP_MASTER_DOWN	1
 
 /*
  * The CARP header layout is as follows:
@@ -120,69 +174,320 @@ struct carp_header {
 	u8	carp_md[CARP_SIG_LEN];
 };
 
+/* An advertisement as laid out in the template, see carp_proto_build_adv() */
+#define CARP_ADV_LEN	(sizeof(struct ethhdr) + sizeof(struct iphdr) + \
+			 sizeof(struct carp_header))
+/* Memory charged for one template, with the headroom of most carpdevs */
+#define CARP_ADV_TRUESIZE	SKB_TRUESIZE(LL_MAX_HEADER + CARP_ADV_LEN)
+
+/*
+ * A bundled advertisement (carp_type CARP_BUNDLE) is a carp_header for the
+ * sending interface followed by a payload carrying one entry for every vhid
+ * the interface is master of. The payload repeats the counter of the header
+ * and the HMAC is computed over the whole payload, so the entries are
+ * authenticated along with the counter.
+ */
+struct carp_bundle_entry {
+	u8	vhid;
+	u8	advskew;
+	u8	advbase;
+	u8	demote;
+};
+
+struct carp_bundle {
+	u32	counter[2];
+	struct carp_bundle_entry entries[0];
+};
+
+/* Largest bundle payload, room for an entry per vhid */
+#define CARP_BUNDLE_ROOM	(sizeof(struct carp_bundle) + \
+				 CARP_MAX_VHID * sizeof(struct carp_bundle_entry))
+
 struct carp_stat {
-	u32	crc_errors;
-	u32	ver_errors;
+	/* bumped by the receive path, on any CPU */
+	atomic_t	crc_errors;
+	atomic_t	ver_errors;
+	atomic_t	hmac_errors;
+	atomic_t	verify_async;
+	atomic_t	bundles_rcvd;
+	atomic_t	rate_drops;
+	atomic_t	peer_drops;
+	atomic_t	interval_errors;
+
 	u32	vhid_errors;
-	u32	hmac_errors;
 	u32	counter_errors;
 
+	u32	bundles_sent;
+
 	u32	mem_errors;
 	u32	xmit_errors;
 
+	u32	adv_deferred;
+	u32	adv_retried;
+	u32	sig_misses;
+
+	u32	md_overruns;
+
 	u32	bytes_sent;
 };
 
+/* Drops before the vhid is known, per namespace and CPU */
+struct carp_net_stat {
+	u32	len_errors;
+	u32	ttl_errors;
+	u32	ver_errors;
+	u32	type_errors;
+	u32	vhid_errors;
+};
+
+struct carp_hmac;
+struct seq_file;
+
 struct carp_net {
     struct net            *net;
     struct list_head       dev_list;
+    struct hlist_head      port_hash[CARP_PORT_HASH_SIZE];
+    struct carp_net_stat __percpu *stat;
     struct proc_dir_entry *proc_dir;
     struct class_attribute class_attr_carp;
 };
 
-struct carp {
-	struct net_device_stats stat;
-	struct net_device      *dev, *odev;
+/* Receive demux counters of a carp port, per CPU */
+struct carp_port_stats {
+    u64                     passed;
+    u64                     steered;
+    u64                     arp_steered;
+    u64                     dropped;
+    u64                     prefiltered;
+    struct u64_stats_sync   syncp;
+};
 
-	char                    name[IFNAMSIZ];
+/* receive rate limiting of one source and vhid, see carp_proto_rate_check() */
+struct carp_rl_entry {
+    __be32                  saddr;
+    u8                      vhid;		/* 0 if the entry is free */
+    u32                     tokens;
+    unsigned long           stamp;
+};
 
-	int	                    link, mlink;
-	struct iphdr            iph;
+struct carp_rl_bucket {
+    spinlock_t              lock;
+    struct carp_rl_entry    ways[CARP_RL_WAYS];
+};
 
-	u32                     md_timeout, adv_timeout;
-	struct timer_list       md_timer, adv_timer;
+/*
+ * State shared by all the carps using the same lower device, see
+ * carp_port.c.
+ */
+struct carp_port {
+    struct hlist_node       hlist;
+    struct net_device      *dev;
+    int                     ifindex;
+    int                     count;
+    struct carp __rcu      *vhids[CARP_MAX_VHID];
+    /* group MAC programmed once for all carps on the device */
+    u8                      mc_addr[ETH_ALEN];
+
+    /* receive demux of the virtual MACs, see carp_port_handle_frame() */
+    struct hlist_head       vmac_hash[CARP_VMAC_HASH_SIZE];
+    struct carp_port_stats __percpu *stats;
+    int                     rx_handler;
+
+    /* receive rate limiting, keyed with rl_seed */
+    struct carp_rl_bucket  *rl;
+    u32                     rl_seed;
+
+    /* advertisement scheduler */
+    spinlock_t              adv_lock;
+    struct list_head        adv_list;
+    struct tasklet_hrtimer  adv_timer;
+
+    struct rcu_head         rcu;
+};
 
-    /* carp params */
-    u8                      vhid;
-    u8                      advbase;
-    u8                      advskew;
-    u8                      version;
+/* carp the advertisement was prepared for, while queued for transmission */
+struct carp_skb_cb {
+    struct carp            *carp;
+};
 
-	enum carp_state         state;
-	struct carp_stat        cstat;
+#define CARP_SKB_CB(skb)   ((struct carp_skb_cb *)((skb)->cb))
+
+/* A pre-computed advertisement signature */
+struct carp_sig {
+	u64                     counter;
+	u8                      md[CARP_SIG_LEN];
+};
+
+/* Data plane counters of a carp interface, per CPU */
+struct carp_pcpu_stats {
+	u64                     rx_packets;
+	u64                     rx_bytes;
+	u64                     tx_packets;
+	u64                     tx_bytes;
+	struct u64_stats_sync   syncp;
+	u32                     rx_dropped;
+	u32                     tx_dropped;
+};
+
+/* A unicast peer, see carp_proto_xmit_peers() */
+struct carp_peer {
+	struct list_head        entry;
+	__be32                  addr;
+	struct rcu_head         rcu;
+};
+
+/*
+ * Configuration and bookkeeping of a carp that the packet paths never
+ * touch. Allocated separately so it stays out of the hot cachelines.
+ */
+struct carp_cold {
+	int                     link, mlink;
+	struct iphdr            iph;
 
 	u8                      carp_key[CARP_KEY_LEN];
 	u8                      carp_pad[CARP_HMAC_PAD_LEN];
-	struct crypto_hash     *hash;
+	u8                      hwaddr[ETH_ALEN];
+	/* virtual MAC in the port's hash and the carpdev's filters, if any */
+	u8                      filter_addr[ETH_ALEN];
+	int                     filter_set;
+	int                     carp_delayed_arp;
+
+	struct proc_dir_entry  *proc_entry;
+	char                    proc_file_name[IFNAMSIZ];
+	struct dentry          *debug_dir;
+	struct dentry          *debug_auth_bench;
+	struct dentry          *debug_rx_bench;
+
+	/* additional vhids hosted by the interface, see carp_node.c */
+	struct list_head        nodes;
+
+	/* unicast peers, under RTNL and RCU; empty for multicast */
+	struct list_head        peers;
+	int                     npeers;
+};
 
-    u8                      hwaddr[ETH_ALEN];
+/*
+ * Per-instance state, grouped by access pattern. The first cacheline holds
+ * what the receive path reads for every advertisement. What it writes, the
+ * election state and the transmit state each start a line of their own so
+ * that writers do not bounce the read-mostly line or each other. The
+ * layout is checked at build time by carp_check_layout().
+ */
+struct carp {
+	/* read on every received advertisement */
+	struct net_device      *dev, *odev;
+	struct carp_port __rcu *port;
+	struct carp_hmac __rcu *hmac;
+	struct carp_cold       *cold;
+
+	u8                      vhid;
+	u8                      advbase;
+	u8                      advskew;
+	u8                      version;
+	enum carp_state         state;
+	int                     carp_bow_out;
+	u8                      bundle;
+
+	/* receive rate limiting, in advertisements per second and source */
+	u32                     rx_rate;
+	u32                     rx_burst;
+
+	/*
+	 * written by the receive path, consumed by the owner tasklet: the
+	 * sample in the upper half, the low word of its counter in the lower
+	 */
+	atomic64_t              rx_sample ____cacheline_aligned_in_smp;
+	unsigned long           events;
+	unsigned long           bundle_until;
+	struct carp_stat        cstat;
 
-    int                     carp_bow_out;
-    int                     carp_delayed_arp;
+	/* election, under lock */
+	spinlock_t              lock ____cacheline_aligned_in_smp;
+	ktime_t                 md_timeout, adv_timeout;
+	ktime_t                 last_rx;
+	u32                     adv_msec;
+	u32                     md_bound_ms;
+	ktime_t                 state_changed;
+	struct tasklet_struct   owner;
+	struct tasklet_hrtimer  md_timer;
+
+	/* advertisement transmission, under adv_lock */
+	spinlock_t              adv_lock ____cacheline_aligned_in_smp;
 	u64                     carp_adv_counter;
+	struct sk_buff         *adv_skb, *adv_spare;
+	struct list_head        adv_entry;
+	ktime_t                 adv_deadline;
+	int                     adv_retries;
+	u64                     bundle_counter;
+	ktime_t                 bundle_sent;
+	struct sk_buff         *bundle_skb;	/* host only */
+
+	/* signatures for the next advertisements */
+	struct carp_sig        *sig_ring;
+	unsigned int            sig_head, sig_count;
+	u32                     sig_gen;
+	struct work_struct      sig_work;
+
+	char                    name[IFNAMSIZ] ____cacheline_aligned_in_smp;
+	struct carp_pcpu_stats __percpu *pcpu_stats;
+	struct list_head        carp_list;
+	struct list_head        node_entry;
+	struct hlist_node       vmac_node;
+	struct rcu_head         rcu;
+};
+
+/* Bytes of struct carp from member a up to member b */
+#define CARP_SPAN(a, b) \
+	(offsetof(struct carp, b) - offsetof(struct carp, a))
+
+/*
+ * State of a vhid as seen by other modules, see carp_vhid_state(). Data
+ * plane code (netfilter, tc classifiers) can branch on it per packet.
+ */
+struct carp_vhid_state {
+	enum carp_state         state;
+	u8                      advbase;
+	u8                      advskew;
+	ktime_t                 changed;	/* monotonic, last transition */
+};
 
-	spinlock_t              lock;
+int carp_vhid_state(struct net_device *, u8, struct carp_vhid_state *);
 
-	u32                     flags;
-	unsigned short          oflags;
+/*
+ * Election policy, see carp_register_policy(). The hook is called from
+ * the owner tasklet for every authenticated advertisement with the local
+ * and received parameters. It may lower or raise the local advbase and
+ * advskew the default comparison uses, or decide on its own.
+ */
+enum carp_policy_verdict {
+	CARP_POLICY_DEFAULT = 0,	/* compare, with ctx->advbase/advskew */
+	CARP_POLICY_MASTER,		/* be master for this vhid */
+	CARP_POLICY_BACKUP,		/* be backup for this vhid */
+	CARP_POLICY_IGNORE,		/* act as if nothing was received */
+};
 
-    struct   proc_dir_entry *proc_entry;
-    char     proc_file_name[IFNAMSIZ];
+struct carp_policy_ctx {
+	struct net_device      *dev;
+	u8                      vhid;
+	enum carp_state         state;
+	u8                      advbase, advskew;	/* local, may be changed */
+	u8                      peer_advbase, peer_advskew, peer_demote;
+};
 
-    struct dentry           *debug_dir;
-    struct list_head         carp_list;
+struct carp_policy_ops {
+	const char             *name;
+	int                   (*elect)(struct carp_policy_ctx *);
 };
 
+int carp_register_policy(struct carp_policy_ops *);
+void carp_unregister_policy(struct carp_policy_ops *);
+
+/* The carp owning the interface a carp or carp node is hosted by */
+static inline struct carp *carp_host(struct carp *carp)
+{
+    return netdev_priv(carp->dev);
+}
+
 static inline char *carp_state_fmt(struct carp *carp)
 {
     switch (carp->state) {
@@ -196,31 +501,100 @@ static inline char *carp_state_fmt(struct carp *carp)
     return NULL;
 }
 
-static inline u32 carp_calculate_timeout(u8 mod, u8 advbase, u8 advskew)
+/*
+ * The advbase advertised. In millisecond mode it carries adv_msec instead,
+ * flagged with CARP_AUTHLEN_MSEC, so that peers compare like with like and
+ * notice when they are configured differently.
+ */
+static inline u8 carp_wire_advbase(struct carp *carp)
 {
-    struct timeval tv;
-    tv.tv_sec = mod * advbase;
-    if (advbase == 0 && advskew == 0)
-        tv.tv_usec = mod * 1000000 / 256;
-    else
-        tv.tv_usec = advskew * 1000000 / 256;
-    return timeval_to_jiffies(&tv);
+    return carp->adv_msec ? carp->adv_msec : carp->advbase;
+}
+
+/*
+ * Timeout of mod advertisement intervals. With adv_msec set the interval is
+ * given in milliseconds and advskew is a 1/256th fraction of it, otherwise
+ * the interval is advbase seconds plus advskew/256 seconds.
+ */
+static inline ktime_t carp_calculate_timeout(u8 mod, u8 advbase, u8 advskew,
+                                             u32 adv_msec)
+{
+    u64 ns;
+
+    if (adv_msec) {
+        ns = (u64)mod * adv_msec * NSEC_PER_MSEC;
+        ns += div_u64((u64)advskew * adv_msec * NSEC_PER_MSEC, 256);
+    } else {
+        ns = (u64)mod * advbase * NSEC_PER_SEC;
+        if (advbase == 0 && advskew == 0)
+            ns += div_u64((u64)mod * NSEC_PER_SEC, 256);
+        else
+            ns += div_u64((u64)advskew * NSEC_PER_SEC, 256);
+    }
+    return ns_to_ktime(ns);
 }
 
 // Implemented in carp.c
-int carp_crypto_hmac(struct carp *, struct scatterlist *, u8 *);
 int carp_set_interface(struct carp *, char *);
 void carp_set_run(struct carp *, sa_family_t);
 void carp_set_state(struct carp *, enum carp_state);
 void carp_master_down(unsigned long);
-struct carp * carp_get_by_vhid(u8);
+int carp_set_intervals(struct carp *, u8, u8, u32);
+void carp_init_state(struct carp *);
+void carp_del_all_timeouts(struct carp *);
+void carp_set_vmac(struct carp *);
+bool carp_dev_master(struct carp *);
+void carp_dev_inherit(struct carp *, bool);
 
 // Implemented in carp_proto.c
-void carp_advertise(unsigned long data);
+int carp_crypto_setkey(struct carp *, const u8 *);
+void carp_crypto_free(struct carp *);
+int carp_crypto_hmac(struct carp *, const u8 *, unsigned int, u8 *);
+int carp_crypto_set_auth(struct carp *, const char *);
+const char *carp_crypto_auth_name(struct carp *);
+void carp_crypto_bench(const u8 *, struct seq_file *);
+void carp_crypto_share(struct carp *, struct carp *);
+int carp_proto_sig_init(struct carp *);
+void carp_proto_sig_free(struct carp *);
+void carp_proto_owner(unsigned long);
+int carp_proto_build_adv(struct carp *);
+void carp_proto_free_adv(struct carp *);
+struct sk_buff *carp_proto_prepare_adv(struct carp *);
+void carp_proto_xmit_list(struct carp_port *, struct sk_buff_head *);
+int carp_proto_peer_add(struct carp *, __be32);
+int carp_proto_peer_del(struct carp *, __be32);
+void carp_proto_peer_flush(struct carp *);
+int carp_proto_peer_ok(struct carp *, __be32);
 int carp_register_protocol(void);
 int carp_unregister_protocol(void);
 
+// Implemented in carp_port.c
+int carp_port_attach(struct carp *);
+void carp_port_detach(struct carp *);
+int carp_port_set_vhid(struct carp *, u8);
+int carp_port_vhid_free(struct carp *, struct net_device *, u8);
+struct carp *carp_get_by_vhid(struct net_device *, u8);
+void carp_port_init_net(struct carp_net *);
+void carp_port_schedule_adv(struct carp *, ktime_t);
+void carp_port_cancel_adv(struct carp *);
+void carp_port_defer_adv(struct carp_port *, struct sk_buff *);
+void carp_port_sync_filter(struct carp *);
+void carp_port_bench(struct carp *, struct seq_file *);
+void carp_port_dump_states(struct carp_net *, struct seq_file *);
+int carp_adv_pending(struct carp *);
+
+// Implemented in carp_node.c
+int carp_node_add(struct carp *, u8, u8);
+int carp_node_del(struct carp *, u8);
+void carp_node_destroy_all(struct carp *);
+void carp_node_rebind(struct carp *);
+void carp_node_sync(struct carp *);
+void carp_node_open(struct carp *);
+void carp_node_close(struct carp *);
+
 // Implemented in carp_debugfs.c
+void carp_debug_register(struct carp *);
+void carp_debug_unregister(struct carp *);
 void carp_create_debugfs(void);
 void carp_destroy_debugfs(void);
 
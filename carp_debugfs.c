@@ -23,6 +23,7 @@
 #include <linux/module.h>
 #include <linux/device.h>
 #include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
 
 #include "carp.h"
 
@@ -31,30 +32,115 @@
 
 static struct dentry *carp_debug_root;
 
+/*
+ * An open debugfs file outlives its carp, so the files hand their inode to
+ * seq_file and read the carp from i_private under RTNL. The carp clears it
+ * in carp_debug_unregister(), under RTNL, before it goes away.
+ */
+static int carp_debug_auth_bench_show(struct seq_file *seq, void *v)
+{
+    struct inode *inode = seq->private;
+    struct carp *carp;
+    u8 key[CARP_KEY_LEN];
+
+    rtnl_lock();
+    carp = inode->i_private;
+    if (carp == NULL) {
+        rtnl_unlock();
+        return -ENODEV;
+    }
+    memcpy(key, carp->cold->carp_key, CARP_KEY_LEN);
+    rtnl_unlock();
+
+    carp_crypto_bench(key, seq);
+    memset(key, 0, sizeof(key));
+    return 0;
+}
+
+static int carp_debug_auth_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, carp_debug_auth_bench_show, inode);
+}
+
+static const struct file_operations carp_debug_auth_bench_fops = {
+    .owner   = THIS_MODULE,
+    .open    = carp_debug_auth_bench_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static int carp_debug_rx_bench_show(struct seq_file *seq, void *v)
+{
+    struct inode *inode = seq->private;
+    int res = 0;
+
+    rtnl_lock();
+    if (inode->i_private)
+        carp_port_bench(inode->i_private, seq);
+    else
+        res = -ENODEV;
+    rtnl_unlock();
+    return res;
+}
+
+static int carp_debug_rx_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, carp_debug_rx_bench_show, inode);
+}
+
+static const struct file_operations carp_debug_rx_bench_fops = {
+    .owner   = THIS_MODULE,
+    .open    = carp_debug_rx_bench_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 void carp_debug_register(struct carp *carp)
 {
     if (!carp_debug_root)
         return;
 
-    carp->debug_dir =
+    carp->cold->debug_dir =
         debugfs_create_dir(carp->dev->name, carp_debug_root);
 
-    if (!carp->debug_dir) {
+    if (!carp->cold->debug_dir) {
         pr_warning("%s: Warning: failed to register to debugfs\n",
             carp->dev->name);
         return;
     }
 
-    //debugfs_create_file("carp_table", 0400, carp->debug_dir,
-    //                    carp, &
+    carp->cold->debug_auth_bench =
+        debugfs_create_file("auth_bench", 0400, carp->cold->debug_dir,
+                            carp, &carp_debug_auth_bench_fops);
+    carp->cold->debug_rx_bench =
+        debugfs_create_file("rx_bench", 0400, carp->cold->debug_dir,
+                            carp, &carp_debug_rx_bench_fops);
 }
 
+static void carp_debug_forget(struct dentry *d)
+{
+    if (!IS_ERR_OR_NULL(d) && d->d_inode)
+        d->d_inode->i_private = NULL;
+}
+
+/* Must be called under RTNL */
 void carp_debug_unregister(struct carp *carp)
 {
+    ASSERT_RTNL();
+
     if (!carp_debug_root)
         return;
 
-    debugfs_remove_recursive(carp->debug_dir);
+    /* files still open see the carp gone from now on */
+    carp_debug_forget(carp->cold->debug_auth_bench);
+    carp_debug_forget(carp->cold->debug_rx_bench);
+    carp->cold->debug_auth_bench = NULL;
+    carp->cold->debug_rx_bench   = NULL;
+
+    debugfs_remove_recursive(carp->cold->debug_dir);
+    carp->cold->debug_dir = NULL;
 }
 
 void carp_debug_reregister(struct carp *carp)
@@ -64,10 +150,10 @@ void carp_debug_reregister(struct carp *carp)
     if (!carp_debug_root)
         return;
 
-    d = debugfs_rename(carp_debug_root, carp->debug_dir, carp_debug_root,
+    d = debugfs_rename(carp_debug_root, carp->cold->debug_dir, carp_debug_root,
                        carp->dev->name);
     if (d) {
-        carp->debug_dir = d;
+        carp->cold->debug_dir = d;
     } else {
         pr_warning("%s: Warning: failed to reregister, "
                    "so just unregister old one\n", carp->dev->name);
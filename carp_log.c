@@ -54,23 +54,21 @@ void dump_addr_info(struct carp *carp)
         printk("n/a");
     }
 
-	printk(", sw=%pI4, dst=%pI4\n", &(carp->iph.saddr), &(carp->iph.daddr));
+	printk(", sw=%pI4, dst=%pI4\n", &(carp->cold->iph.saddr), &(carp->cold->iph.daddr));
 }
 
 void dump_hmac_params(struct carp *carp)
 {
 	int i;
 	u8 carp_md[CARP_SIG_LEN];
-	struct scatterlist sg;
 
-    sg_set_buf(&sg, &carp->carp_adv_counter, sizeof(carp->carp_adv_counter));
-
-    if (carp_crypto_hmac(carp, &sg, carp_md))
+    if (carp_crypto_hmac(carp, (u8 *)&carp->carp_adv_counter,
+                         sizeof(carp->carp_adv_counter), carp_md))
         return;
 
 	printk(KERN_INFO "key: ");
 	for (i=0; i<CARP_KEY_LEN; ++i)
-		printk("%02x ", carp->carp_key[i]);
+		printk("%02x ", carp->cold->carp_key[i]);
 	printk("\n");
 
 	printk("counter: %llx ", carp->carp_adv_counter);
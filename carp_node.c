@@ -0,0 +1,280 @@
+/*
+ * carp_node.c -- additional vhids hosted by a carp interface
+ *
+ * Copyright (c) 2012 Damien Churchill <damoxc@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/rculist.h>
+#include <linux/rtnetlink.h>
+#include <linux/netdevice.h>
+
+#include "carp.h"
+#include "carp_log.h"
+
+/*
+ * Besides its own vhid, a carp interface can host any number of carp
+ * nodes, in the manner of OpenBSD's carpnodes. A node is a struct carp
+ * of its own with a vhid, advskew, state, timers and advertisement
+ * template, but it has no net_device: it shares the interface, its lower
+ * device, port binding, key and cold section with the carp that hosts it.
+ * Nodes do not keep a pre-signed signature ring and sign inline.
+ *
+ * The node list lives in the cold section. It is modified under RTNL and
+ * may be walked under RCU; nodes are freed after a grace period.
+ */
+
+static struct carp *carp_node_find(struct carp *carp, u8 vhid)
+{
+    struct carp *node;
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry)
+        if (node->vhid == vhid)
+            return node;
+    return NULL;
+}
+
+/* Copy the interface wide settings of the hosting carp to a node */
+static void carp_node_inherit(struct carp *node, struct carp *carp)
+{
+    node->md_bound_ms = carp->md_bound_ms;
+    node->rx_rate     = carp->rx_rate;
+    node->rx_burst    = carp->rx_burst;
+
+    if (carp_set_intervals(node, carp->advbase, node->advskew,
+                           carp->adv_msec)) {
+        pr_warn("%s: advskew %d exceeds the master down bound of %u ms, "
+                "not bounding this vhid.\n",
+                node->name, node->advskew, node->md_bound_ms);
+        node->md_bound_ms = 0;
+        carp_set_intervals(node, carp->advbase, node->advskew,
+                           carp->adv_msec);
+    }
+}
+
+/* Unpublish a node; it is freed by carp_node_free() after a grace period */
+static void carp_node_unlink(struct carp *node)
+{
+    list_del_rcu(&node->node_entry);
+    tasklet_disable(&node->owner);
+    carp_port_detach(node);
+}
+
+static void carp_node_free(struct carp *node)
+{
+    tasklet_enable(&node->owner);
+    carp_del_all_timeouts(node);
+    carp_crypto_free(node);
+    carp_proto_free_adv(node);
+    kfree_rcu(node, rcu);
+}
+
+static void carp_node_destroy(struct carp *node)
+{
+    carp_node_unlink(node);
+
+    /* receive paths that found the node are done with it after this */
+    synchronize_net();
+    carp_node_free(node);
+}
+
+/*
+ * Add a node for vhid to the carp interface. Must be called under RTNL.
+ */
+int carp_node_add(struct carp *carp, u8 vhid, u8 advskew)
+{
+    struct carp *node;
+    int res, nid = NUMA_NO_NODE;
+
+    ASSERT_RTNL();
+
+    if (vhid == 0)
+        return -EINVAL;
+
+    if (vhid == carp->vhid || carp_node_find(carp, vhid))
+        return -EEXIST;
+
+    if (carp->odev && carp->odev->dev.parent)
+        nid = dev_to_node(carp->odev->dev.parent);
+
+    node = kzalloc_node(sizeof(struct carp), GFP_KERNEL, nid);
+    if (node == NULL)
+        return -ENOMEM;
+
+    node->dev     = carp->dev;
+    node->odev    = carp->odev;
+    node->cold    = carp->cold;
+    node->vhid    = vhid;
+    node->advskew = advskew;
+    node->version = carp->version;
+    node->state   = INIT;
+    snprintf(node->name, IFNAMSIZ, "%s:%u", carp->name, vhid);
+
+    carp_init_state(node);
+    carp_node_inherit(node, carp);
+    carp_crypto_share(node, carp);
+
+    /* the node is reachable from the receive path once attached */
+    if (node->odev) {
+        res = carp_proto_build_adv(node);
+        if (res)
+            goto err_free;
+
+        res = carp_port_attach(node);
+        if (res) {
+            carp_proto_free_adv(node);
+            goto err_free;
+        }
+    }
+
+    list_add_tail_rcu(&node->node_entry, &carp->cold->nodes);
+
+    if (carp->dev->flags & IFF_UP)
+        carp_set_run(node, 0);
+
+    return 0;
+
+err_free:
+    carp_crypto_free(node);
+    kfree(node);
+    return res;
+}
+
+/*
+ * Remove the node for vhid from the carp interface. Must be called under
+ * RTNL.
+ */
+int carp_node_del(struct carp *carp, u8 vhid)
+{
+    struct carp *node;
+
+    ASSERT_RTNL();
+
+    node = carp_node_find(carp, vhid);
+    if (node == NULL)
+        return -ENOENT;
+
+    carp_node_destroy(node);
+    return 0;
+}
+
+/* Called from ndo_uninit under RTNL */
+void carp_node_destroy_all(struct carp *carp)
+{
+    struct list_head *head = &carp->cold->nodes, *pos, *next;
+    struct carp *node, *tmp;
+
+    if (list_empty(head))
+        return;
+
+    /*
+     * list_del_rcu() leaves the next pointers alone, so the unlinked nodes
+     * still chain from the first one to the head, and one grace period
+     * covers them all.
+     */
+    pos = head->next;
+    list_for_each_entry_safe(node, tmp, head, node_entry)
+        carp_node_unlink(node);
+
+    synchronize_net();
+
+    for (; pos != head; pos = next) {
+        next = pos->next;
+        carp_node_free(list_entry(pos, struct carp, node_entry));
+    }
+}
+
+/*
+ * Follow the hosting carp to its current lower device. A node whose vhid
+ * is already taken there stays unbound. Must be called under RTNL.
+ */
+void carp_node_rebind(struct carp *carp)
+{
+    struct carp *node;
+    int err;
+
+    ASSERT_RTNL();
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry) {
+        carp_port_detach(node);
+        node->odev = carp->odev;
+        if (node->odev == NULL)
+            continue;
+
+        err = carp_port_attach(node);
+        if (err) {
+            pr_err("%s: unable to bind vhid %d to %s: %d\n", node->name,
+                   node->vhid, node->odev->name, err);
+            continue;
+        }
+
+        if (carp_proto_build_adv(node))
+            pr_err("%s: failed to build advertisement\n", node->name);
+
+        /* the detach dropped any pending advertisement */
+        spin_lock_bh(&node->lock);
+        carp_set_run(node, 0);
+        spin_unlock_bh(&node->lock);
+    }
+}
+
+/*
+ * Propagate advbase, adv_msec, md_bound_ms and the receive rate limit of
+ * the hosting carp to its nodes. Must be called under RTNL.
+ */
+void carp_node_sync(struct carp *carp)
+{
+    struct carp *node;
+
+    ASSERT_RTNL();
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry) {
+        carp_node_inherit(node, carp);
+        if (carp_proto_build_adv(node))
+            pr_err("%s: failed to build advertisement\n", node->name);
+    }
+}
+
+/*
+ * Called when the carp interface or its carpdev comes up or goes down,
+ * under RTNL. Nodes already running are left alone.
+ */
+void carp_node_open(struct carp *carp)
+{
+    struct carp *node;
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry)
+        if (node->state == INIT)
+            carp_set_run(node, 0);
+}
+
+void carp_node_close(struct carp *carp)
+{
+    struct carp *node;
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry) {
+        carp_del_all_timeouts(node);
+
+        node->carp_bow_out = 1;
+        carp_proto_adv(node);
+        node->carp_bow_out = 0;
+
+        carp_set_state(node, INIT);
+    }
+}
@@ -0,0 +1,864 @@
+/*
+ * carp_port.c -- per lower device state shared by carp instances
+ *
+ * Copyright (c) 2012 Damien Churchill <damoxc@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/rtnetlink.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/hrtimer.h>
+#include <linux/etherdevice.h>
+#include <linux/if_arp.h>
+#include <linux/inetdevice.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/export.h>
+#include <net/ip.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#include "carp.h"
+#include "carp_log.h"
+
+/*
+ * Every lower device (carpdev) used by at least one carp instance gets a
+ * carp_port. The port holds a table indexed directly by vhid, so that the
+ * receive path can find the instance an advertisement belongs to with one
+ * hash lookup on the ifindex and one array dereference, regardless of the
+ * number of configured instances.
+ *
+ * The tables are only modified under RTNL and read under RCU.
+ */
+
+static inline struct hlist_head *carp_port_head(struct carp_net *cn,
+                                                int ifindex)
+{
+    return &cn->port_hash[hash_32(ifindex, CARP_PORT_HASH_BITS)];
+}
+
+static struct carp_port *carp_port_find(struct carp_net *cn,
+                                        struct net_device *dev)
+{
+    struct carp_port *port;
+
+    hlist_for_each_entry_rcu(port, carp_port_head(cn, dev->ifindex), hlist) {
+        if (port->dev == dev)
+            return port;
+    }
+    return NULL;
+}
+
+/*----------------------------- Advertisement scheduler ----------------------*/
+
+/*
+ * Advertisements of all the carps on a port are driven by one timer.
+ * Each carp on the port's adv_list has a deadline; when the timer fires
+ * every advertisement that is due is prepared and the whole batch is
+ * handed to the lower device under a single TX lock acquisition.
+ */
+
+#define CARP_ADV_BATCH  32
+
+/* Called with port->adv_lock held */
+static void carp_port_rearm(struct carp_port *port)
+{
+    struct carp *carp;
+    ktime_t expires = ktime_set(0, 0);
+    int found = 0;
+
+    list_for_each_entry(carp, &port->adv_list, adv_entry) {
+        if (!found || ktime_to_ns(carp->adv_deadline) < ktime_to_ns(expires))
+            expires = carp->adv_deadline;
+        found = 1;
+    }
+
+    if (found)
+        tasklet_hrtimer_start(&port->adv_timer, expires, HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart carp_port_adv_timer(struct hrtimer *timer)
+{
+    struct carp_port *port =
+        container_of(timer, struct carp_port, adv_timer.timer);
+    struct carp *batch[CARP_ADV_BATCH];
+    struct sk_buff_head list;
+    struct sk_buff *skb;
+    struct carp *carp;
+    ktime_t due;
+    int i, n;
+
+    __skb_queue_head_init(&list);
+
+    /* carps are only freed an RCU grace period after leaving adv_list */
+    rcu_read_lock();
+
+    /*
+     * Advertisements due within CARP_ADV_SLACK_NS are sent with this batch
+     * rather than waking up again for each of them.
+     */
+    due = ktime_add_ns(ktime_get(), CARP_ADV_SLACK_NS);
+
+    do {
+        n = 0;
+        spin_lock(&port->adv_lock);
+        list_for_each_entry(carp, &port->adv_list, adv_entry) {
+            if (ktime_to_ns(carp->adv_deadline) > ktime_to_ns(due))
+                continue;
+            carp->adv_deadline = ktime_add(due, carp->adv_timeout);
+            batch[n++] = carp;
+            if (n == CARP_ADV_BATCH)
+                break;
+        }
+        spin_unlock(&port->adv_lock);
+
+        for (i = 0; i < n; i++) {
+            skb = carp_proto_prepare_adv(batch[i]);
+            if (skb)
+                __skb_queue_tail(&list, skb);
+        }
+    } while (n == CARP_ADV_BATCH);
+
+    if (!skb_queue_empty(&list))
+        carp_proto_xmit_list(port, &list);
+
+    rcu_read_unlock();
+
+    spin_lock(&port->adv_lock);
+    carp_port_rearm(port);
+    spin_unlock(&port->adv_lock);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * An advertisement that found the TX queue stopped is dropped rather than
+ * held for later: by the time the queue restarts its counter would be
+ * stale. The carp is instead rescheduled CARP_ADV_RETRY_NS from now, up to
+ * CARP_ADV_RETRIES times in a row, and a fresh advertisement is prepared
+ * then. A bow-out is not retried. Called from carp_proto_xmit_list() with
+ * BHs disabled.
+ */
+void carp_port_defer_adv(struct carp_port *port, struct sk_buff *skb)
+{
+    struct carp *carp = CARP_SKB_CB(skb)->carp;
+    struct carp *host = carp_host(carp);
+    struct hrtimer *timer = &port->adv_timer.timer;
+
+    kfree_skb(skb);
+
+    if (carp->adv_retries++ == 0)
+        carp->cstat.adv_deferred++;
+
+    if (carp->carp_bow_out || carp->adv_retries > CARP_ADV_RETRIES) {
+        carp->cstat.xmit_errors++;
+        carp->adv_retries = 0;
+        return;
+    }
+
+    /* a bundle that did not go out must not suppress the retry */
+    spin_lock(&host->adv_lock);
+    carp->bundle_sent = ktime_set(0, 0);
+    spin_unlock(&host->adv_lock);
+
+    spin_lock(&port->adv_lock);
+    if (!list_empty(&carp->adv_entry)) {
+        carp->adv_deadline = ktime_add_ns(ktime_get(), CARP_ADV_RETRY_NS);
+        if (!hrtimer_active(timer) ||
+            ktime_to_ns(carp->adv_deadline) < ktime_to_ns(hrtimer_get_expires(timer)))
+            tasklet_hrtimer_start(&port->adv_timer, carp->adv_deadline,
+                                  HRTIMER_MODE_ABS);
+    }
+    spin_unlock(&port->adv_lock);
+}
+
+/*
+ * (Re)schedule the next advertisement of the carp delay from now. Called
+ * from the owner tasklet as well as under RTNL, so the port may be going
+ * away; a carp detached meanwhile is not put back on the port's list.
+ */
+void carp_port_schedule_adv(struct carp *carp, ktime_t delay)
+{
+    struct carp_port *port;
+    struct hrtimer *timer;
+
+    rcu_read_lock();
+    port = rcu_dereference(carp->port);
+    if (port == NULL)
+        goto out;
+
+    timer = &port->adv_timer.timer;
+
+    spin_lock_bh(&port->adv_lock);
+    if (rcu_access_pointer(carp->port) != port)
+        goto out_unlock;
+    carp->adv_deadline = ktime_add(ktime_get(), delay);
+    if (list_empty(&carp->adv_entry))
+        list_add_tail(&carp->adv_entry, &port->adv_list);
+    if (!hrtimer_active(timer) ||
+        ktime_to_ns(carp->adv_deadline) < ktime_to_ns(hrtimer_get_expires(timer)))
+        tasklet_hrtimer_start(&port->adv_timer, carp->adv_deadline,
+                              HRTIMER_MODE_ABS);
+out_unlock:
+    spin_unlock_bh(&port->adv_lock);
+out:
+    rcu_read_unlock();
+}
+
+static void __carp_port_cancel_adv(struct carp_port *port, struct carp *carp)
+{
+    spin_lock_bh(&port->adv_lock);
+    list_del_init(&carp->adv_entry);
+    carp->adv_retries = 0;
+    spin_unlock_bh(&port->adv_lock);
+}
+
+void carp_port_cancel_adv(struct carp *carp)
+{
+    struct carp_port *port;
+
+    rcu_read_lock();
+    port = rcu_dereference(carp->port);
+    if (port)
+        __carp_port_cancel_adv(port, carp);
+    rcu_read_unlock();
+}
+
+int carp_adv_pending(struct carp *carp)
+{
+    return !list_empty(&carp->adv_entry);
+}
+
+/*----------------------------- Receive demux --------------------------------*/
+
+/*
+ * The port registers an rx_handler on the carpdev, in the manner of
+ * macvlan. Frames addressed to the virtual MAC of a carp interface, and
+ * ARP requests for one of its addresses, are handed to the carp interface;
+ * everything else passes through untouched. The interface only receives
+ * while it is master of a vhid; otherwise these frames are dropped, so a
+ * backup neither answers for nor accepts traffic to the virtual addresses.
+ *
+ * The virtual MACs are hashed on their last byte, which is the vhid for
+ * the default 00:00:5e:00:01:<vhid>. The hash is modified under RTNL along
+ * with the address filters and read under RCU.
+ */
+static inline struct hlist_head *carp_port_vmac_head(struct carp_port *port,
+                                                     const u8 *addr)
+{
+    return &port->vmac_hash[addr[ETH_ALEN - 1] & (CARP_VMAC_HASH_SIZE - 1)];
+}
+
+static struct carp *carp_port_vmac_find(struct carp_port *port,
+                                        const u8 *addr)
+{
+    struct carp *carp;
+
+    hlist_for_each_entry_rcu(carp, carp_port_vmac_head(port, addr),
+                             vmac_node) {
+        if (ether_addr_equal(carp->cold->filter_addr, addr))
+            return carp;
+    }
+    return NULL;
+}
+
+/* The carp interface owning the target address of an ARP request, if any */
+static struct carp *carp_port_arp_find(struct carp_port *port,
+                                       struct sk_buff *skb)
+{
+    struct arphdr *arp;
+    struct in_device *in_dev;
+    struct in_ifaddr *ifa;
+    struct carp *carp;
+    __be32 tip;
+    int i;
+
+    /* the skb may be shared with taps, so it is not pulled here */
+    if (skb_headlen(skb) < arp_hdr_len(skb->dev))
+        return NULL;
+
+    arp = arp_hdr(skb);
+    if (arp->ar_hrd != htons(ARPHRD_ETHER) || arp->ar_pro != htons(ETH_P_IP) ||
+        arp->ar_hln != ETH_ALEN || arp->ar_pln != 4 ||
+        arp->ar_op != htons(ARPOP_REQUEST))
+        return NULL;
+
+    /* sender hw, sender ip, target hw, target ip */
+    memcpy(&tip, (u8 *)(arp + 1) + 2 * ETH_ALEN + 4, 4);
+
+    for (i = 0; i < CARP_VMAC_HASH_SIZE; i++) {
+        hlist_for_each_entry_rcu(carp, &port->vmac_hash[i], vmac_node) {
+            in_dev = __in_dev_get_rcu(carp->dev);
+            if (in_dev == NULL)
+                continue;
+            for (ifa = in_dev->ifa_list; ifa; ifa = ifa->ifa_next)
+                if (ifa->ifa_local == tip)
+                    return carp;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Find the carp interface a frame is for, or NULL if it is none of ours.
+ * This is all the work done for frames that are not, see carp_port_bench().
+ */
+static struct carp *carp_port_classify(struct carp_port *port,
+                                       struct sk_buff *skb, int *arp)
+{
+    const struct ethhdr *eth = eth_hdr(skb);
+
+    *arp = 0;
+    if (!is_multicast_ether_addr(eth->h_dest))
+        return carp_port_vmac_find(port, eth->h_dest);
+
+    if (skb->protocol == htons(ETH_P_ARP) &&
+        is_broadcast_ether_addr(eth->h_dest)) {
+        *arp = 1;
+        return carp_port_arp_find(port, skb);
+    }
+    return NULL;
+}
+
+/*
+ * With the prefilter parameter set, advertisements are checked here, before
+ * the IP input path, against what the receive path would drop anyway: bad
+ * TTL or length, a vhid not hosted on the device, or a source that is not
+ * a configured peer. The vhid table of the port is the instance table the
+ * receive path uses, so the prefilter is always in sync with it. Fragments,
+ * options and frames not in the linear area are left to the stack.
+ * Returns true if the frame should be dropped.
+ */
+static bool carp_port_prefilter(struct carp_port *port, struct sk_buff *skb)
+{
+    const struct iphdr *iph;
+    const struct carp_header *ch;
+    struct carp *carp;
+    unsigned int ihl, len;
+
+    if (skb->protocol != htons(ETH_P_IP) ||
+        skb_headlen(skb) < sizeof(struct iphdr))
+        return false;
+
+    iph = (const struct iphdr *)skb->data;
+    if (iph->protocol != IPPROTO_CARP || iph->version != 4 ||
+        (iph->frag_off & htons(IP_MF | IP_OFFSET)))
+        return false;
+
+    ihl = iph->ihl * 4;
+    len = ntohs(iph->tot_len);
+    if (ihl < sizeof(struct iphdr) || len < ihl + sizeof(struct carp_header) ||
+        len > skb->len)
+        return true;
+
+    if (iph->ttl != CARP_TTL)
+        return true;
+
+    if (skb_headlen(skb) < ihl + sizeof(struct carp_header))
+        return false;
+
+    ch = (const struct carp_header *)(skb->data + ihl);
+    carp = rcu_dereference(port->vhids[ch->carp_vhid]);
+    if (carp == NULL)
+        return true;
+
+    return !carp_proto_peer_ok(carp, iph->saddr);
+}
+
+static rx_handler_result_t carp_port_handle_frame(struct sk_buff **pskb)
+{
+    struct sk_buff *skb = *pskb;
+    struct carp_port *port = rcu_dereference(skb->dev->rx_handler_data);
+    struct carp_port_stats *ps = this_cpu_ptr(port->stats);
+    struct carp_pcpu_stats *cs;
+    struct carp *carp;
+    int arp;
+
+    if (unlikely(skb->pkt_type == PACKET_LOOPBACK))
+        return RX_HANDLER_PASS;
+
+    carp = carp_port_classify(port, skb, &arp);
+    if (carp == NULL) {
+        if (carp_prefilter && carp_port_prefilter(port, skb)) {
+            u64_stats_update_begin(&ps->syncp);
+            ps->prefiltered++;
+            u64_stats_update_end(&ps->syncp);
+            kfree_skb(skb);
+            return RX_HANDLER_CONSUMED;
+        }
+
+        u64_stats_update_begin(&ps->syncp);
+        ps->passed++;
+        u64_stats_update_end(&ps->syncp);
+        return RX_HANDLER_PASS;
+    }
+
+    cs = this_cpu_ptr(carp->pcpu_stats);
+
+    if (!(carp->dev->flags & IFF_UP) || !carp_dev_master(carp))
+        goto drop;
+
+    skb = skb_share_check(skb, GFP_ATOMIC);
+    if (skb == NULL)
+        goto drop_stats;
+
+    skb->dev = carp->dev;
+    if (!arp)
+        skb->pkt_type = PACKET_HOST;
+
+    u64_stats_update_begin(&ps->syncp);
+    if (arp)
+        ps->arp_steered++;
+    else
+        ps->steered++;
+    u64_stats_update_end(&ps->syncp);
+
+    u64_stats_update_begin(&cs->syncp);
+    cs->rx_packets++;
+    cs->rx_bytes += skb->len + ETH_HLEN;
+    u64_stats_update_end(&cs->syncp);
+
+    *pskb = skb;
+    return RX_HANDLER_ANOTHER;
+
+drop:
+    kfree_skb(skb);
+drop_stats:
+    cs->rx_dropped++;
+    u64_stats_update_begin(&ps->syncp);
+    ps->dropped++;
+    u64_stats_update_end(&ps->syncp);
+    return RX_HANDLER_CONSUMED;
+}
+
+/*
+ * Time the classification of a frame that is not for any carp interface,
+ * which is the overhead the rx_handler adds to all other traffic on the
+ * carpdev, and show the port's counters. Must be called under RTNL.
+ */
+void carp_port_bench(struct carp *carp, struct seq_file *seq)
+{
+    struct carp_port_stats *ps, sum = { 0 };
+    u64 passed, steered, arp_steered, dropped, prefiltered;
+    struct carp_port *port;
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+    ktime_t start;
+    s64 ns;
+    unsigned int begin;
+    int cpu, i, arp, hits = 0;
+
+    ASSERT_RTNL();
+
+    port = rtnl_dereference(carp->port);
+    if (port == NULL || !port->rx_handler) {
+        seq_printf(seq, "%s: no receive demux\n", carp->name);
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        ps = per_cpu_ptr(port->stats, cpu);
+        do {
+            begin       = u64_stats_fetch_begin_bh(&ps->syncp);
+            passed      = ps->passed;
+            steered     = ps->steered;
+            arp_steered = ps->arp_steered;
+            dropped     = ps->dropped;
+            prefiltered = ps->prefiltered;
+        } while (u64_stats_fetch_retry_bh(&ps->syncp, begin));
+
+        sum.passed      += passed;
+        sum.steered     += steered;
+        sum.arp_steered += arp_steered;
+        sum.dropped     += dropped;
+        sum.prefiltered += prefiltered;
+    }
+
+    seq_printf(seq, "%s: passed %llu steered %llu arp %llu dropped %llu "
+               "prefiltered %llu\n", port->dev->name, sum.passed,
+               sum.steered, sum.arp_steered, sum.dropped, sum.prefiltered);
+
+    skb = alloc_skb(ETH_HLEN + sizeof(struct iphdr), GFP_KERNEL);
+    if (skb == NULL)
+        return;
+
+    eth = (struct ethhdr *)skb_put(skb, ETH_HLEN);
+    skb_reset_mac_header(skb);
+    eth_random_addr(eth->h_dest);
+    memcpy(eth->h_source, port->dev->dev_addr, ETH_ALEN);
+    eth->h_proto  = htons(ETH_P_IP);
+    skb->protocol = eth->h_proto;
+    skb->dev      = port->dev;
+
+    rcu_read_lock();
+    start = ktime_get();
+    for (i = 0; i < CARP_RX_BENCH_LOOPS; i++)
+        hits += carp_port_classify(port, skb, &arp) != NULL;
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    rcu_read_unlock();
+
+    seq_printf(seq, "non-carp frame: %lld ns/frame over %d frames (%d hits)\n",
+               div_s64(ns, CARP_RX_BENCH_LOOPS), CARP_RX_BENCH_LOOPS, hits);
+
+    kfree_skb(skb);
+}
+
+/*----------------------------- Port management ------------------------------*/
+
+/*
+ * Instead of putting the carpdev into IFF_ALLMULTI, the port programs its
+ * address filters with exactly what the carps on it need to receive: the
+ * group MAC of the advertisements, once for the whole device, and the
+ * virtual MAC of each carp interface. Filters are programmed while a carp
+ * is bound to the device and removed when it leaves. Under RTNL.
+ */
+static int carp_port_addr_add(struct net_device *dev, const u8 *addr)
+{
+    if (is_multicast_ether_addr(addr))
+        return dev_mc_add(dev, addr);
+    return dev_uc_add(dev, addr);
+}
+
+static void carp_port_addr_del(struct net_device *dev, const u8 *addr)
+{
+    if (is_multicast_ether_addr(addr))
+        dev_mc_del(dev, addr);
+    else
+        dev_uc_del(dev, addr);
+}
+
+static void carp_port_filter_del(struct carp_port *port, struct carp *carp)
+{
+    struct carp_cold *cold = carp->cold;
+
+    if (carp_host(carp) != carp || !cold->filter_set)
+        return;
+
+    hlist_del_init_rcu(&carp->vmac_node);
+    if (!ether_addr_equal(cold->filter_addr, port->mc_addr))
+        carp_port_addr_del(port->dev, cold->filter_addr);
+    cold->filter_set = 0;
+}
+
+static void carp_port_filter_add(struct carp_port *port, struct carp *carp)
+{
+    struct carp_cold *cold = carp->cold;
+    const u8 *addr = carp->dev->dev_addr;
+
+    /* nodes share the virtual MAC of the interface that hosts them */
+    if (carp_host(carp) != carp || cold->filter_set)
+        return;
+
+    /* a virtual MAC equal to the group MAC is already programmed */
+    if (!ether_addr_equal(addr, port->mc_addr) &&
+        carp_port_addr_add(port->dev, addr)) {
+        pr_err("%s: failed to add %pM to the filters of %s\n",
+               carp->name, addr, port->dev->name);
+        return;
+    }
+
+    memcpy(cold->filter_addr, addr, ETH_ALEN);
+    cold->filter_set = 1;
+    hlist_add_head_rcu(&carp->vmac_node, carp_port_vmac_head(port, addr));
+}
+
+/* Reprogram the virtual MAC after it changed. Must be called under RTNL. */
+void carp_port_sync_filter(struct carp *carp)
+{
+    ASSERT_RTNL();
+
+    struct carp_port *port = rtnl_dereference(carp->port);
+
+    if (port == NULL)
+        return;
+
+    carp_port_filter_del(port, carp);
+    carp_port_filter_add(port, carp);
+}
+
+static struct carp_port *carp_port_create(struct carp_net *cn,
+                                          struct net_device *dev,
+                                          __be32 group)
+{
+    struct carp_port *port;
+    int i;
+
+    port = kzalloc(sizeof(struct carp_port), GFP_KERNEL);
+    if (!port)
+        return NULL;
+
+    port->stats = alloc_percpu(struct carp_port_stats);
+    if (!port->stats)
+        goto err_free;
+
+    port->rl = kcalloc(CARP_RL_BUCKETS, sizeof(struct carp_rl_bucket),
+                       GFP_KERNEL);
+    if (!port->rl)
+        goto err_free;
+    for (i = 0; i < CARP_RL_BUCKETS; i++)
+        spin_lock_init(&port->rl[i].lock);
+    get_random_bytes(&port->rl_seed, sizeof(port->rl_seed));
+
+    ip_eth_mc_map(group, port->mc_addr);
+    if (dev_mc_add(dev, port->mc_addr))
+        goto err_free;
+
+    port->dev     = dev;
+    port->ifindex = dev->ifindex;
+
+    /*
+     * A device enslaved elsewhere (bridge, bond, macvlan) already has an
+     * rx_handler. Advertisements are still received through the protocol
+     * handler, only the virtual MACs are not steered.
+     */
+    if (netdev_rx_handler_register(dev, carp_port_handle_frame, port))
+        pr_warn("%s: rx_handler busy, carp interfaces on it will not "
+                "receive\n", dev->name);
+    else
+        port->rx_handler = 1;
+
+    spin_lock_init(&port->adv_lock);
+    INIT_LIST_HEAD(&port->adv_list);
+    tasklet_hrtimer_init(&port->adv_timer, carp_port_adv_timer,
+                         CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+
+    hlist_add_head_rcu(&port->hlist, carp_port_head(cn, dev->ifindex));
+    carp_dbg("%s: created carp port\n", dev->name);
+    return port;
+
+err_free:
+    kfree(port->rl);
+    free_percpu(port->stats);
+    kfree(port);
+    return NULL;
+}
+
+static void carp_port_free_rcu(struct rcu_head *head)
+{
+    struct carp_port *port = container_of(head, struct carp_port, rcu);
+
+    kfree(port->rl);
+    free_percpu(port->stats);
+    kfree(port);
+}
+
+static void carp_port_destroy(struct carp_port *port)
+{
+    carp_dbg("%s: destroying carp port\n", port->dev->name);
+    if (port->rx_handler)
+        netdev_rx_handler_unregister(port->dev);
+    tasklet_hrtimer_cancel(&port->adv_timer);
+    dev_mc_del(port->dev, port->mc_addr);
+    hlist_del_rcu(&port->hlist);
+    call_rcu(&port->rcu, carp_port_free_rcu);
+}
+
+/*
+ * Bind the carp to the port of its carpdev, creating the port if this is
+ * the first carp on the device. The carp is entered into the vhid table if
+ * it already has a vhid. Must be called under RTNL.
+ */
+int carp_port_attach(struct carp *carp)
+{
+    struct carp_net *cn = net_generic(dev_net(carp->dev), carp_net_id);
+    struct carp_port *port;
+
+    ASSERT_RTNL();
+
+    if (carp->odev == NULL)
+        return -ENODEV;
+
+    if (rtnl_dereference(carp->port))
+        return 0;
+
+    port = carp_port_find(cn, carp->odev);
+    if (port && carp->vhid && rtnl_dereference(port->vhids[carp->vhid]))
+        return -EEXIST;
+
+    if (!port) {
+        port = carp_port_create(cn, carp->odev, carp->cold->iph.daddr);
+        if (!port)
+            return -ENOMEM;
+    }
+
+    port->count++;
+    rcu_assign_pointer(carp->port, port);
+    if (carp->vhid)
+        rcu_assign_pointer(port->vhids[carp->vhid], carp);
+    carp_port_filter_add(port, carp);
+
+    return 0;
+}
+
+/*
+ * Remove the carp from its port, destroying the port once the last carp
+ * using it has gone. Must be called under RTNL. The owner tasklet may still
+ * run; it reads carp->port under RCU, and carp_port_schedule_adv() checks it
+ * again under the port's adv_lock, so clearing it before the schedule is
+ * cancelled keeps the carp off the port's list for good.
+ */
+void carp_port_detach(struct carp *carp)
+{
+    struct carp_port *port = rtnl_dereference(carp->port);
+
+    ASSERT_RTNL();
+
+    if (port == NULL)
+        return;
+
+    RCU_INIT_POINTER(carp->port, NULL);
+    __carp_port_cancel_adv(port, carp);
+    carp_port_filter_del(port, carp);
+
+    if (carp->vhid && rtnl_dereference(port->vhids[carp->vhid]) == carp)
+        RCU_INIT_POINTER(port->vhids[carp->vhid], NULL);
+
+    if (--port->count == 0)
+        carp_port_destroy(port);
+}
+
+/*
+ * Whether vhid is free for the carp on the port of dev, so that callers
+ * moving the carp can check before they change anything. Must be called
+ * under RTNL.
+ */
+int carp_port_vhid_free(struct carp *carp, struct net_device *dev, u8 vhid)
+{
+    struct carp_net *cn = net_generic(dev_net(dev), carp_net_id);
+    struct carp_port *port;
+    struct carp *other;
+
+    ASSERT_RTNL();
+
+    port = carp_port_find(cn, dev);
+    if (port == NULL || vhid == 0)
+        return 1;
+
+    other = rtnl_dereference(port->vhids[vhid]);
+    return other == NULL || other == carp;
+}
+
+/*
+ * Move the carp to a new slot in the vhid table of its port. Must be
+ * called under RTNL.
+ */
+int carp_port_set_vhid(struct carp *carp, u8 vhid)
+{
+    struct carp_port *port = rtnl_dereference(carp->port);
+    struct carp *other;
+
+    ASSERT_RTNL();
+
+    if (carp->vhid == vhid)
+        return 0;
+
+    if (port) {
+        other = vhid ? rtnl_dereference(port->vhids[vhid]) : NULL;
+        if (other && other != carp)
+            return -EEXIST;
+
+        if (carp->vhid && rtnl_dereference(port->vhids[carp->vhid]) == carp)
+            RCU_INIT_POINTER(port->vhids[carp->vhid], NULL);
+        if (vhid)
+            rcu_assign_pointer(port->vhids[vhid], carp);
+    }
+
+    carp->vhid = vhid;
+    return 0;
+}
+
+/*
+ * Find the carp handling vhid on the lower device dev. Must be called
+ * under rcu_read_lock(), which the protocol handlers already hold.
+ */
+struct carp *carp_get_by_vhid(struct net_device *dev, u8 vhid)
+{
+    struct carp_net *cn = net_generic(dev_net(dev), carp_net_id);
+    struct carp_port *port;
+
+    port = carp_port_find(cn, dev);
+    if (port == NULL)
+        return NULL;
+
+    return rcu_dereference(port->vhids[vhid]);
+}
+
+/*
+ * Look up the state of vhid on the carpdev dev, for use by other modules
+ * from their packet paths. This is the same lookup the receive path does:
+ * one hash on the ifindex and one array index. Must be called under
+ * rcu_read_lock(). Returns -ENOENT if no carp handles the vhid there.
+ */
+int carp_vhid_state(struct net_device *dev, u8 vhid,
+                    struct carp_vhid_state *st)
+{
+    struct carp *carp = carp_get_by_vhid(dev, vhid);
+
+    if (carp == NULL)
+        return -ENOENT;
+
+    st->state   = ACCESS_ONCE(carp->state);
+    st->advbase = carp->advbase;
+    st->advskew = carp->advskew;
+    st->changed = carp->state_changed;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(carp_vhid_state);
+
+/* /proc/net/carp/vhids: the vhid table of every port in the namespace */
+void carp_port_dump_states(struct carp_net *cn, struct seq_file *seq)
+{
+    static const char *carp_states[] = { CARP_STATES };
+    struct carp_port *port;
+    struct carp *carp;
+    s64 now = ktime_to_ms(ktime_get());
+    int i, vhid;
+
+    seq_printf(seq, "%-16s %-16s %4s %-6s %7s %7s %10s\n", "carpdev", "name",
+               "vhid", "state", "advbase", "advskew", "since_ms");
+
+    rcu_read_lock();
+    for (i = 0; i < CARP_PORT_HASH_SIZE; i++) {
+        hlist_for_each_entry_rcu(port, &cn->port_hash[i], hlist) {
+            for (vhid = 1; vhid < CARP_MAX_VHID; vhid++) {
+                carp = rcu_dereference(port->vhids[vhid]);
+                if (carp == NULL)
+                    continue;
+
+                seq_printf(seq, "%-16s %-16s %4d %-6s %7u %7u %10lld\n",
+                           port->dev->name, carp->name, vhid,
+                           carp_states[carp->state], carp->advbase,
+                           carp->advskew, ktime_to_ns(carp->state_changed) ?
+                           now - ktime_to_ms(carp->state_changed) : -1LL);
+            }
+        }
+    }
+    rcu_read_unlock();
+}
+
+void carp_port_init_net(struct carp_net *cn)
+{
+    int i;
+
+    for (i = 0; i < CARP_PORT_HASH_SIZE; i++)
+        INIT_HLIST_HEAD(&cn->port_hash[i]);
+}
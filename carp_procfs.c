@@ -20,6 +20,8 @@
  */
 
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
 #include <linux/export.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
@@ -34,7 +36,7 @@ static void *carp_info_seq_start(struct seq_file *seq, loff_t *pos)
     carp_dbg("%s: pos=%lld", __func__, *pos);
 
     rcu_read_lock();
-    spin_lock(&carp->lock);
+    spin_lock_bh(&carp->lock);
 
     if (*pos == 0)
         return carp;
@@ -54,7 +56,7 @@ static void carp_info_seq_stop(struct seq_file *seq, void *v)
 {
     struct carp *carp = seq->private;
     carp_dbg("%s", __func__);
-    spin_unlock(&carp->lock);
+    spin_unlock_bh(&carp->lock);
     rcu_read_unlock();
 }
 
@@ -62,19 +64,45 @@ static int carp_info_seq_show(struct seq_file *seq, void *v)
 {
     struct carp *carp = seq->private;
     struct carp_stat *carp_stat = &(carp->cstat);
+    struct net_device *odev;
+    struct carp *node;
 
     seq_printf(seq, "%s\n", DRV_DESC);
     seq_printf(seq, "State: %s\n", carp_state_fmt(carp));
-    seq_printf(seq, "Device: %s\n", carp->odev->name);
+
+    /* the carpdev can be unregistered under us, and is put after a grace period */
+    rcu_read_lock();
+    odev = ACCESS_ONCE(carp->odev);
+    seq_printf(seq, "Device: %s\n", odev ? odev->name : "(none)");
+    rcu_read_unlock();
+
     seq_printf(seq, "Bytes Sent: %d\n", carp_stat->bytes_sent);
     seq_printf(seq, "VHID: %d\n", carp->vhid);
     seq_printf(seq, "Adv Base: %d\n", carp->advbase);
     seq_printf(seq, "Adv Skew: %d\n", carp->advskew);
-    seq_printf(seq, "CRC Errors: %d\n", carp_stat->crc_errors);
-    seq_printf(seq, "HMAC Errors: %d\n", carp_stat->hmac_errors);
-    seq_printf(seq, "Ver Errors: %d\n", carp_stat->ver_errors);
+    seq_printf(seq, "Adv Interval: %lld us\n", ktime_to_us(carp->adv_timeout));
+    seq_printf(seq, "Master Down: %lld us\n", ktime_to_us(carp->md_timeout));
+    seq_printf(seq, "CRC Errors: %d\n", atomic_read(&carp_stat->crc_errors));
+    seq_printf(seq, "HMAC Errors: %d\n", atomic_read(&carp_stat->hmac_errors));
+    seq_printf(seq, "Ver Errors: %d\n", atomic_read(&carp_stat->ver_errors));
+    seq_printf(seq, "Async Verified: %d\n", atomic_read(&carp_stat->verify_async));
+    seq_printf(seq, "Bundles Sent: %d\n", carp_stat->bundles_sent);
+    seq_printf(seq, "Bundles Rcvd: %d\n", atomic_read(&carp_stat->bundles_rcvd));
+    seq_printf(seq, "Rate Drops: %d\n", atomic_read(&carp_stat->rate_drops));
+    seq_printf(seq, "Peer Drops: %d\n", atomic_read(&carp_stat->peer_drops));
+    seq_printf(seq, "Interval Errors: %d\n", atomic_read(&carp_stat->interval_errors));
     seq_printf(seq, "Mem Errors: %d\n", carp_stat->mem_errors);
     seq_printf(seq, "Xmit Errors: %d\n", carp_stat->xmit_errors);
+    seq_printf(seq, "Adv Deferred: %d\n", carp_stat->adv_deferred);
+    seq_printf(seq, "Adv Retried: %d\n", carp_stat->adv_retried);
+    seq_printf(seq, "Sig Misses: %d\n", carp_stat->sig_misses);
+    seq_printf(seq, "MD Overruns: %d\n", carp_stat->md_overruns);
+
+    /* the carp nodes, under the RCU read lock taken in start */
+    list_for_each_entry_rcu(node, &carp->cold->nodes, node_entry)
+        seq_printf(seq, "Node: vhid %d skew %d %s hmac errors %d\n",
+                   node->vhid, node->advskew, carp_state_fmt(node),
+                   atomic_read(&node->cstat.hmac_errors));
 
     return 0;
 }
@@ -111,20 +139,80 @@ static const struct file_operations carp_info_fops = {
     .release = seq_release,
 };
 
+/*
+ * /proc/net/carp/stats: advertisements dropped before they could be matched
+ * to a carp in this namespace.
+ */
+static int carp_stats_seq_show(struct seq_file *seq, void *v)
+{
+    struct carp_net *cn = seq->private;
+    struct carp_net_stat *st, sum = { 0 };
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(cn->stat, cpu);
+        sum.len_errors  += st->len_errors;
+        sum.ttl_errors  += st->ttl_errors;
+        sum.ver_errors  += st->ver_errors;
+        sum.type_errors += st->type_errors;
+        sum.vhid_errors += st->vhid_errors;
+    }
+
+    seq_printf(seq, "Len Errors: %u\n", sum.len_errors);
+    seq_printf(seq, "TTL Errors: %u\n", sum.ttl_errors);
+    seq_printf(seq, "Ver Errors: %u\n", sum.ver_errors);
+    seq_printf(seq, "Type Errors: %u\n", sum.type_errors);
+    seq_printf(seq, "VHID Errors: %u\n", sum.vhid_errors);
+
+    return 0;
+}
+
+static int carp_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, carp_stats_seq_show, PDE(inode)->data);
+}
+
+static const struct file_operations carp_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = carp_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static int carp_vhids_seq_show(struct seq_file *seq, void *v)
+{
+    carp_port_dump_states(seq->private, seq);
+    return 0;
+}
+
+static int carp_vhids_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, carp_vhids_seq_show, PDE(inode)->data);
+}
+
+static const struct file_operations carp_vhids_fops = {
+    .owner   = THIS_MODULE,
+    .open    = carp_vhids_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 void carp_create_proc_entry(struct carp *carp)
 {
     struct net_device *carp_dev = carp->dev;
     struct carp_net *cn = net_generic(dev_net(carp_dev), carp_net_id);
 
     if (cn->proc_dir) {
-        carp->proc_entry = proc_create_data(carp_dev->name,
+        carp->cold->proc_entry = proc_create_data(carp_dev->name,
                                             S_IRUGO, cn->proc_dir,
                                             &carp_info_fops, carp);
-        if (carp->proc_entry== NULL)
+        if (carp->cold->proc_entry== NULL)
             pr_warning("Warning: Cannot create /proc/net/%s/%s\n",
                        DRV_NAME, carp_dev->name);
         else
-            memcpy(carp->proc_file_name, carp_dev->name, IFNAMSIZ);
+            memcpy(carp->cold->proc_file_name, carp_dev->name, IFNAMSIZ);
     }
 }
 
@@ -133,10 +221,10 @@ void carp_remove_proc_entry(struct carp *carp)
     struct net_device *carp_dev = carp->dev;
     struct carp_net *cn = net_generic(dev_net(carp_dev), carp_net_id);
 
-    if (cn->proc_dir && carp->proc_entry) {
-        remove_proc_entry(carp->proc_file_name, cn->proc_dir);
-        memset(carp->proc_file_name, 0, IFNAMSIZ);
-        carp->proc_entry = NULL;
+    if (cn->proc_dir && carp->cold->proc_entry) {
+        remove_proc_entry(carp->cold->proc_file_name, cn->proc_dir);
+        memset(carp->cold->proc_file_name, 0, IFNAMSIZ);
+        carp->cold->proc_entry = NULL;
     }
 }
 
@@ -144,15 +232,29 @@ void __net_init carp_create_proc_dir(struct carp_net *cn)
 {
     if (!cn->proc_dir) {
         cn->proc_dir = proc_mkdir(DRV_NAME, cn->net->proc_net);
-        if (!cn->proc_dir)
+        if (!cn->proc_dir) {
             pr_warning("Warning: cannot create /proc/net/%s\n",
                 DRV_NAME);
+            return;
+        }
+
+        if (!proc_create_data("stats", S_IRUGO, cn->proc_dir,
+                              &carp_stats_fops, cn))
+            pr_warning("Warning: cannot create /proc/net/%s/stats\n",
+                DRV_NAME);
+
+        if (!proc_create_data("vhids", S_IRUGO, cn->proc_dir,
+                              &carp_vhids_fops, cn))
+            pr_warning("Warning: cannot create /proc/net/%s/vhids\n",
+                DRV_NAME);
     }
 }
 
 void __net_exit carp_destroy_proc_dir(struct carp_net *cn)
 {
     if (cn->proc_dir) {
+        remove_proc_entry("stats", cn->proc_dir);
+        remove_proc_entry("vhids", cn->proc_dir);
         remove_proc_entry(DRV_NAME, cn->net->proc_net);
         cn->proc_dir = NULL;
     }
@@ -21,275 +21,1851 @@
 
 #include <linux/kernel.h>
 #include <linux/crypto.h>
+#include <linux/export.h>
+#include <linux/interrupt.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/pkt_sched.h>
+#include <linux/random.h>
+#include <linux/rtnetlink.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include <crypto/hash.h>
 
 #include <net/checksum.h>
 #include <net/ip.h>
 #include <net/protocol.h>
+#include <net/route.h>
+#include <net/netns/generic.h>
+
+#include "carp.h"
+#include "carp_log.h"
+
+static void carp_proto_verify_queue(struct sk_buff *);
+static void carp_proto_rcv_bundle(struct carp *, struct sk_buff *);
+static int carp_proto_rcv(struct carp *, struct carp_header *);
+
+/*----------------------------- Crypto functions ----------------------------*/
+
+/*
+ * Advertisement authenticators. The wire format has room for CARP_SIG_LEN
+ * bytes of digest, so hashes with a longer output are truncated to it.
+ * hmac(sha1) stays the default for interoperability with other CARP
+ * implementations; both ends of a vhid must be configured alike.
+ */
+struct carp_auth_ops {
+    const char *name;
+    const char *alg;
+    int (*digest)(struct shash_desc *, const u8 *, unsigned int, u8 *);
+};
+
+static int carp_auth_digest(struct shash_desc *desc, const u8 *data,
+                            unsigned int len, u8 *carp_md)
+{
+    return crypto_shash_digest(desc, data, len, carp_md);
+}
+
+static int carp_auth_digest_trunc(struct shash_desc *desc, const u8 *data,
+                                  unsigned int len, u8 *carp_md)
+{
+    u8 md[CARP_AUTH_MAX_DIGEST];
+    int res;
+
+    res = crypto_shash_digest(desc, data, len, md);
+    memcpy(carp_md, md, CARP_SIG_LEN);
+    return res;
+}
+
+static const struct carp_auth_ops carp_auth_algs[] = {
+    { "sha1",   "hmac(sha1)",   carp_auth_digest },
+    { "sha256", "hmac(sha256)", carp_auth_digest_trunc },
+};
+
+static const struct carp_auth_ops *carp_auth_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(carp_auth_algs); i++)
+        if (strcmp(carp_auth_algs[i].name, name) == 0)
+            return &carp_auth_algs[i];
+    return NULL;
+}
+
+/*
+ * A keyed authenticator transform. The hmac template precomputes the inner
+ * and outer pad states in setkey, so the transform is keyed once when the
+ * key changes and is then only read. Each CPU hashes with its own
+ * descriptor so signing and verifying can run concurrently.
+ *
+ * With batched verification enabled the key is also loaded into an ahash
+ * transform, which may be backed by an asynchronous driver. Requests in
+ * flight on it outlive the RCU read section that found it, so they hold a
+ * reference and the last one frees the transforms from a work item.
+ */
+struct carp_hmac {
+    const struct carp_auth_ops *ops;
+    u32                        gen;
+    struct crypto_shash        *tfm;
+    struct shash_desc __percpu *desc;
+    struct crypto_ahash        *atfm;
+    atomic_t                   refcnt;
+    struct work_struct         free_work;
+};
+
+/* Distinguishes signatures made with different keys or authenticators */
+static atomic_t carp_hmac_gen = ATOMIC_INIT(0);
+
+static void carp_hmac_free(struct carp_hmac *hmac)
+{
+    if (hmac == NULL)
+        return;
+
+    if (!IS_ERR_OR_NULL(hmac->atfm))
+        crypto_free_ahash(hmac->atfm);
+    free_percpu(hmac->desc);
+    crypto_free_shash(hmac->tfm);
+    kfree(hmac);
+}
+
+static void carp_hmac_free_work(struct work_struct *work)
+{
+    carp_hmac_free(container_of(work, struct carp_hmac, free_work));
+}
+
+static void carp_hmac_put(struct carp_hmac *hmac)
+{
+    if (hmac && atomic_dec_and_test(&hmac->refcnt))
+        schedule_work(&hmac->free_work);
+}
+
+/* Called under rcu_read_lock */
+static struct carp_hmac *carp_hmac_get(struct carp *carp)
+{
+    struct carp_hmac *hmac = rcu_dereference(carp->hmac);
+
+    if (hmac && !atomic_inc_not_zero(&hmac->refcnt))
+        hmac = NULL;
+    return hmac;
+}
+
+static struct carp_hmac *carp_hmac_alloc(const struct carp_auth_ops *ops,
+                                         const u8 *key, unsigned int keylen)
+{
+    struct carp_hmac *hmac;
+    int res;
+
+    hmac = kzalloc(sizeof(struct carp_hmac), GFP_KERNEL);
+    if (hmac == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    hmac->ops = ops;
+    hmac->gen = atomic_inc_return(&carp_hmac_gen);
+    atomic_set(&hmac->refcnt, 1);
+    INIT_WORK(&hmac->free_work, carp_hmac_free_work);
+
+    hmac->tfm = crypto_alloc_shash(ops->alg, 0, CRYPTO_ALG_ASYNC);
+    if (IS_ERR(hmac->tfm)) {
+        res = PTR_ERR(hmac->tfm);
+        pr_err("Failed to allocate %s hash.\n", ops->alg);
+        kfree(hmac);
+        return ERR_PTR(res);
+    }
+
+    res = -EINVAL;
+    if (crypto_shash_digestsize(hmac->tfm) < CARP_SIG_LEN ||
+        crypto_shash_digestsize(hmac->tfm) > CARP_AUTH_MAX_DIGEST)
+        goto err_out;
+
+    res = crypto_shash_setkey(hmac->tfm, key, keylen);
+    if (res)
+        goto err_out;
+
+    res = -ENOMEM;
+    hmac->desc = __alloc_percpu(sizeof(struct shash_desc) +
+                                crypto_shash_descsize(hmac->tfm),
+                                CRYPTO_MINALIGN);
+    if (hmac->desc == NULL)
+        goto err_out;
+
+    if (carp_verify_batch) {
+        /* async implementations allowed; fall back to sync on failure */
+        hmac->atfm = crypto_alloc_ahash(ops->alg, 0, 0);
+        if (IS_ERR(hmac->atfm)) {
+            pr_warn("Failed to allocate async %s hash, "
+                    "verifying synchronously.\n", ops->alg);
+            hmac->atfm = NULL;
+        } else if (crypto_ahash_setkey(hmac->atfm, key, keylen)) {
+            crypto_free_ahash(hmac->atfm);
+            hmac->atfm = NULL;
+        }
+    }
+
+    return hmac;
+
+err_out:
+    carp_hmac_free(hmac);
+    return ERR_PTR(res);
+}
+
+/* Point the carp at hmac, returning the transform it used before */
+static struct carp_hmac *carp_crypto_swap(struct carp *carp,
+                                          struct carp_hmac *hmac)
+{
+    struct carp_hmac *old;
+
+    spin_lock_bh(&carp->lock);
+    old = rcu_dereference_protected(carp->hmac, lockdep_is_held(&carp->lock));
+    rcu_assign_pointer(carp->hmac, hmac);
+    spin_unlock_bh(&carp->lock);
+
+    return old;
+}
+
+/*
+ * Install a new transform on the carp and on the nodes it hosts, which
+ * each hold a reference on the same transform as the carp.
+ */
+static int carp_crypto_install(struct carp *carp,
+                               const struct carp_auth_ops *ops, const u8 *key)
+{
+    struct carp_hmac *hmac, *old;
+    struct carp *node;
+    int refs = 1;
+
+    hmac = carp_hmac_alloc(ops, key, CARP_KEY_LEN);
+    if (IS_ERR(hmac))
+        return PTR_ERR(hmac);
+
+    spin_lock_bh(&carp->lock);
+    memcpy(carp->cold->carp_key, key, sizeof(carp->cold->carp_key));
+    spin_unlock_bh(&carp->lock);
+
+    old = carp_crypto_swap(carp, hmac);
+
+    list_for_each_entry(node, &carp->cold->nodes, node_entry) {
+        atomic_inc(&hmac->refcnt);
+        carp_crypto_swap(node, hmac);
+        refs++;
+    }
+
+    if (old) {
+        synchronize_rcu();
+        while (refs--)
+            carp_hmac_put(old);
+    }
+
+    /* signatures made with the old key are discarded when popped */
+    if (carp->sig_ring)
+        schedule_work(&carp->sig_work);
+    return 0;
+}
+
+/* Called under RTNL, which serialises key and authenticator changes */
+static const struct carp_auth_ops *carp_crypto_ops(struct carp *carp)
+{
+    struct carp_hmac *hmac = rcu_dereference_rtnl(carp->hmac);
+
+    return hmac ? hmac->ops : &carp_auth_algs[0];
+}
+
+/*
+ * Set the key used to sign and verify advertisements. Runs the key schedule
+ * once; the packet paths only ever use the pre-keyed transform.
+ * Called from process context under RTNL.
+ */
+int carp_crypto_setkey(struct carp *carp, const u8 *key)
+{
+    return carp_crypto_install(carp, carp_crypto_ops(carp), key);
+}
+
+/*
+ * Switch the authenticator, keeping the key. Called from process context
+ * under RTNL.
+ */
+int carp_crypto_set_auth(struct carp *carp, const char *name)
+{
+    const struct carp_auth_ops *ops = carp_auth_find(name);
+    u8 key[CARP_KEY_LEN];
+
+    if (ops == NULL)
+        return -ENOENT;
+
+    memcpy(key, carp->cold->carp_key, sizeof(key));
+    return carp_crypto_install(carp, ops, key);
+}
+
+const char *carp_crypto_auth_name(struct carp *carp)
+{
+    struct carp_hmac *hmac;
+    const char *name = carp_auth_algs[0].name;
+
+    rcu_read_lock();
+    hmac = rcu_dereference(carp->hmac);
+    if (hmac)
+        name = hmac->ops->name;
+    rcu_read_unlock();
+
+    return name;
+}
+
+/* Give a carp node a reference on the transform of its host, under RTNL */
+void carp_crypto_share(struct carp *node, struct carp *carp)
+{
+    struct carp_hmac *hmac = rtnl_dereference(carp->hmac);
+
+    if (hmac)
+        atomic_inc(&hmac->refcnt);
+    RCU_INIT_POINTER(node->hmac, hmac);
+}
+
+/*
+ * Drop the carp's reference on its transform. Called under RTNL once the
+ * carp can no longer be found and a grace period has passed, so that no
+ * reader is left on carp->hmac, see carp_dev_uninit().
+ */
+void carp_crypto_free(struct carp *carp)
+{
+    struct carp_hmac *hmac = rtnl_dereference(carp->hmac);
+
+    RCU_INIT_POINTER(carp->hmac, NULL);
+    carp_hmac_put(hmac);
+}
+
+int carp_crypto_hmac(struct carp *carp, const u8 *data, unsigned int len,
+                     u8 *carp_md)
+{
+    struct carp_hmac *hmac;
+    struct shash_desc *desc;
+    int res = -ENOKEY;
+
+    local_bh_disable();
+    rcu_read_lock();
+
+    hmac = rcu_dereference(carp->hmac);
+    if (hmac) {
+        desc = this_cpu_ptr(hmac->desc);
+        desc->tfm   = hmac->tfm;
+        desc->flags = 0;
+        res = hmac->ops->digest(desc, data, len, carp_md);
+    }
+
+    rcu_read_unlock();
+    local_bh_enable();
+
+    return res;
+}
+
+/*
+ * Sign a run of counters with the current key. Returns the generation of
+ * the key used, or 0 if the carp has none.
+ */
+static u32 carp_crypto_sign_sigs(struct carp *carp, struct carp_sig *sigs,
+                                 int n)
+{
+    struct carp_hmac *hmac;
+    struct shash_desc *desc;
+    __be32 counter[2];
+    u32 gen = 0;
+    int i;
+
+    local_bh_disable();
+    rcu_read_lock();
+
+    hmac = rcu_dereference(carp->hmac);
+    if (hmac) {
+        desc = this_cpu_ptr(hmac->desc);
+        desc->tfm   = hmac->tfm;
+        desc->flags = 0;
+        gen = hmac->gen;
+
+        for (i = 0; i < n && gen; i++) {
+            counter[0] = htonl((sigs[i].counter >> 32) & 0xffffffff);
+            counter[1] = htonl(sigs[i].counter & 0xffffffff);
+            if (hmac->ops->digest(desc, (u8 *)counter, sizeof(counter),
+                                  sigs[i].md))
+                gen = 0;
+        }
+    }
+
+    rcu_read_unlock();
+    local_bh_enable();
+
+    return gen;
+}
+
+static void carp_hmac_sign(struct carp *carp, struct carp_header *carp_hdr)
+{
+    carp_crypto_hmac(carp, (u8 *)carp_hdr->carp_counter,
+                     sizeof(carp_hdr->carp_counter), carp_hdr->carp_md);
+}
+
+static int carp_hmac_verify(struct carp *carp, struct carp_header *carp_hdr)
+{
+    u8 tmp_md[CARP_SIG_LEN];
+    int res;
+
+    res = carp_crypto_hmac(carp, (u8 *)carp_hdr->carp_counter,
+                           sizeof(carp_hdr->carp_counter), tmp_md);
+    if (res)
+        return res;
+
+    return memcmp(tmp_md, carp_hdr->carp_md, CARP_SIG_LEN);
+}
+
+/*
+ * Time signing and verifying CARP_AUTH_BENCH_LOOPS advertisements with
+ * every authenticator, keyed with a copy of the instance key. Backs the
+ * auth_bench debugfs file. Called from process context.
+ */
+void carp_crypto_bench(const u8 *key, struct seq_file *seq)
+{
+    const struct carp_auth_ops *ops;
+    struct carp_hmac *hmac;
+    struct shash_desc *desc;
+    u8 md[CARP_SIG_LEN], tmp_md[CARP_SIG_LEN];
+    __be32 counter[2];
+    ktime_t start;
+    s64 sign_ns, verify_ns;
+    int i, n, bad;
+
+    for (n = 0; n < ARRAY_SIZE(carp_auth_algs); n++) {
+        ops = &carp_auth_algs[n];
+
+        hmac = carp_hmac_alloc(ops, key, CARP_KEY_LEN);
+        if (IS_ERR(hmac)) {
+            seq_printf(seq, "%-8s unavailable (%ld)\n", ops->name,
+                       PTR_ERR(hmac));
+            continue;
+        }
+
+        desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(hmac->tfm),
+                       GFP_KERNEL);
+        if (desc == NULL) {
+            carp_hmac_free(hmac);
+            return;
+        }
+        desc->tfm   = hmac->tfm;
+        desc->flags = 0;
+
+        start = ktime_get();
+        for (i = 0; i < CARP_AUTH_BENCH_LOOPS; i++) {
+            counter[0] = htonl(i);
+            counter[1] = htonl(~i);
+            ops->digest(desc, (u8 *)counter, sizeof(counter), md);
+        }
+        sign_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+        bad = 0;
+        start = ktime_get();
+        for (i = 0; i < CARP_AUTH_BENCH_LOOPS; i++) {
+            ops->digest(desc, (u8 *)counter, sizeof(counter), tmp_md);
+            bad += memcmp(tmp_md, md, CARP_SIG_LEN) != 0;
+        }
+        verify_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+        seq_printf(seq, "%-8s %-24s sign %lld ns verify %lld ns%s\n",
+                   ops->name,
+                   crypto_tfm_alg_driver_name(crypto_shash_tfm(hmac->tfm)),
+                   div_s64(sign_ns, CARP_AUTH_BENCH_LOOPS),
+                   div_s64(verify_ns, CARP_AUTH_BENCH_LOOPS),
+                   bad ? " MISMATCH" : "");
+
+        kfree(desc);
+        carp_hmac_free(hmac);
+        cond_resched();
+    }
+}
+
+/*----------------------------- Proto  functions ----------------------------*/
+
+/*
+ * Build the advertisement template for the carp. Everything but the
+ * counter, HMAC, IP id and checksums stays the same from one advertisement
+ * to the next, so the headers are only constructed here, whenever the
+ * vhid, advbase, advskew or carpdev change. A spare copy is built along
+ * with it for when the driver still holds the template, see
+ * carp_proto_get_adv(). Called from process context.
+ */
+int carp_proto_build_adv(struct carp *carp)
+{
+    struct sk_buff *skb, *spare, *bundle, *old, *old_spare, *old_bundle;
+    struct ethhdr *eth;
+    struct iphdr *ip;
+    struct carp_header *ch;
+    int len;
+
+    if (carp->odev == NULL) {
+        carp_proto_free_adv(carp);
+        return 0;
+    }
+
+    len = CARP_ADV_LEN;
+
+    skb = alloc_skb(LL_RESERVED_SPACE(carp->odev) + len, GFP_KERNEL);
+    if (!skb)
+        return -ENOMEM;
+
+    skb_reserve(skb, LL_RESERVED_SPACE(carp->odev));
+
+    eth = (struct ethhdr *)skb_put(skb, sizeof(struct ethhdr));
+    skb_reset_mac_header(skb);
+    ip = (struct iphdr *)skb_put(skb, sizeof(struct iphdr));
+    skb_set_network_header(skb, sizeof(struct ethhdr));
+    ch = (struct carp_header *)skb_put(skb, sizeof(struct carp_header));
+    skb_set_transport_header(skb, sizeof(struct ethhdr) + sizeof(struct iphdr));
+
+    memset(&(IPCB(skb)->opt), 0, sizeof(IPCB(skb)->opt));
+
+    ip_eth_mc_map(carp->cold->iph.daddr, eth->h_dest);
+    memcpy(eth->h_source, carp->odev->dev_addr, ETH_ALEN);
+    eth->h_proto 	= htons(ETH_P_IP);
+
+    ip->ihl      = 5;
+    ip->version  = 4;
+    ip->tos      = IPTOS_PREC_INTERNETCONTROL;
+    ip->tot_len  = htons(len - sizeof(struct ethhdr));
+    ip->frag_off = 0;
+    ip->ttl      = CARP_TTL;
+    ip->protocol = IPPROTO_CARP;
+    ip->check    = 0;
+    ip->saddr    = carp->cold->iph.saddr;
+    ip->daddr    = carp->cold->iph.daddr;
+    get_random_bytes(&ip->id, 2);
+    ip_send_check(ip);
+
+    memset(ch, 0, sizeof(struct carp_header));
+    ch->carp_type    = CARP_ADVERTISEMENT;
+    ch->carp_version = CARP_VERSION;
+    ch->carp_demote  = 0;
+    ch->carp_authlen = CARP_AUTHLEN;
+    if (carp_host(carp)->bundle != CARP_BUNDLE_OFF)
+        ch->carp_authlen |= CARP_AUTHLEN_BUNDLE;
+    if (carp->adv_msec)
+        ch->carp_authlen |= CARP_AUTHLEN_MSEC;
+    ch->carp_vhid    = carp->vhid;
+    ch->carp_advbase = carp_wire_advbase(carp);
+    ch->carp_advskew = carp->advskew;
+
+    skb->protocol   = __constant_htons(ETH_P_IP);
+    skb->pkt_type   = PACKET_MULTICAST;
+    skb->priority   = TC_PRIO_CONTROL;
+
+    spare = skb_copy(skb, GFP_KERNEL);
+    if (!spare) {
+        kfree_skb(skb);
+        return -ENOMEM;
+    }
+
+    /* an interface that may bundle keeps a bundle sized for every vhid */
+    bundle = NULL;
+    if (carp_host(carp) == carp && carp->bundle != CARP_BUNDLE_OFF) {
+        bundle = skb_copy_expand(skb, skb_headroom(skb), CARP_BUNDLE_ROOM,
+                                 GFP_KERNEL);
+        if (!bundle) {
+            kfree_skb(spare);
+            kfree_skb(skb);
+            return -ENOMEM;
+        }
+    }
+
+    spin_lock_bh(&carp->adv_lock);
+    old = carp->adv_skb;
+    old_spare = carp->adv_spare;
+    old_bundle = carp->bundle_skb;
+    carp->adv_skb = skb;
+    carp->adv_spare = spare;
+    carp->bundle_skb = bundle;
+    spin_unlock_bh(&carp->adv_lock);
+
+    if (old)
+        kfree_skb(old);
+    if (old_spare)
+        kfree_skb(old_spare);
+    if (old_bundle)
+        kfree_skb(old_bundle);
+    return 0;
+}
+
+void carp_proto_free_adv(struct carp *carp)
+{
+    struct sk_buff *old, *old_spare, *old_bundle;
+
+    spin_lock_bh(&carp->adv_lock);
+    old = carp->adv_skb;
+    old_spare = carp->adv_spare;
+    old_bundle = carp->bundle_skb;
+    carp->adv_skb = NULL;
+    carp->adv_spare = NULL;
+    carp->bundle_skb = NULL;
+    spin_unlock_bh(&carp->adv_lock);
+
+    if (old)
+        kfree_skb(old);
+    if (old_spare)
+        kfree_skb(old_spare);
+    if (old_bundle)
+        kfree_skb(old_bundle);
+}
+
+/*
+ * Return the template ready to be patched. The driver normally releases
+ * its reference long before the next advertisement is due, in which case
+ * the template is reused in place. A driver that reclaims its TX ring
+ * lazily may still hold it; the frame is then carried over to the spare
+ * built with the template, and the two swap roles. Only if the driver
+ * holds both is the template copied, which may fail under memory pressure.
+ * Called with carp->adv_lock held.
+ */
+static struct sk_buff *carp_proto_get_adv(struct carp *carp)
+{
+    struct sk_buff *skb = carp->adv_skb, *nskb;
+
+    if (skb == NULL || !skb_shared(skb))
+        return skb;
+
+    nskb = carp->adv_spare;
+    if (nskb && !skb_shared(nskb)) {
+        /* same layout; this carries the IP id over as well */
+        memcpy(nskb->data, skb->data, skb->len);
+        carp->adv_spare = skb;
+        carp->adv_skb = nskb;
+        return nskb;
+    }
+
+    nskb = skb_copy(skb, GFP_ATOMIC);
+    if (nskb == NULL)
+        return NULL;
+
+    carp->adv_skb = nskb;
+    kfree_skb(skb);
+    return nskb;
+}
+
+/*
+ * Pre-computed signatures. The advertisement counter only ever steps by
+ * one, so the HMACs of the next advertisements are known in advance. A
+ * work item keeps a ring of them signed ahead of the counter, and the
+ * advertisement timer copies the digest instead of hashing. Entries are
+ * tagged with the key generation; an entry for another key or counter
+ * (after a rekey or after adopting a peer's counter) empties the ring and
+ * the advertisement is signed inline.
+ */
+static void carp_proto_sig_refill(struct work_struct *work)
+{
+    struct carp *carp = container_of(work, struct carp, sig_work);
+    struct carp_sig sigs[CARP_SIG_BATCH];
+    unsigned int i, n, tail;
+    u64 next;
+    u32 gen;
+
+    for (;;) {
+        spin_lock_bh(&carp->adv_lock);
+        if (carp->sig_ring == NULL) {
+            spin_unlock_bh(&carp->adv_lock);
+            return;
+        }
+        n = min_t(unsigned int, CARP_SIG_RING - carp->sig_count,
+                  CARP_SIG_BATCH);
+        if (carp->sig_count) {
+            tail = (carp->sig_head + carp->sig_count - 1) % CARP_SIG_RING;
+            next = carp->sig_ring[tail].counter + 1;
+        } else {
+            next = carp->carp_adv_counter + 1;
+        }
+        spin_unlock_bh(&carp->adv_lock);
+
+        if (n == 0)
+            return;
+
+        for (i = 0; i < n; i++)
+            sigs[i].counter = next + i;
+
+        gen = carp_crypto_sign_sigs(carp, sigs, n);
+        if (gen == 0)
+            return;
+
+        spin_lock_bh(&carp->adv_lock);
+        if (carp->sig_ring == NULL) {
+            n = 0;
+        } else if (carp->sig_count == 0) {
+            /* the counter may have moved on while we were signing */
+            while (n && sigs[0].counter <= carp->carp_adv_counter)
+                memmove(sigs, sigs + 1, --n * sizeof(sigs[0]));
+            if (n && sigs[0].counter != carp->carp_adv_counter + 1)
+                n = 0;
+            carp->sig_head = 0;
+            carp->sig_gen  = gen;
+        } else {
+            tail = (carp->sig_head + carp->sig_count - 1) % CARP_SIG_RING;
+            if (carp->sig_gen != gen ||
+                carp->sig_ring[tail].counter + 1 != next)
+                n = 0;
+        }
+        n = min_t(unsigned int, n, CARP_SIG_RING - carp->sig_count);
+        for (i = 0; i < n; i++) {
+            tail = (carp->sig_head + carp->sig_count) % CARP_SIG_RING;
+            carp->sig_ring[tail] = sigs[i];
+            carp->sig_count++;
+        }
+        spin_unlock_bh(&carp->adv_lock);
+
+        if (n == 0)
+            return;
+
+        cond_resched();
+    }
+}
+
+/* Copy the signature for the current counter. Called with adv_lock held. */
+static int carp_proto_sig_pop(struct carp *carp, struct carp_header *ch)
+{
+    struct carp_hmac *hmac;
+    struct carp_sig *sig;
+    int found = 0;
+
+    if (carp->sig_count == 0)
+        goto out;
+
+    rcu_read_lock();
+    hmac = rcu_dereference(carp->hmac);
+    sig  = &carp->sig_ring[carp->sig_head];
+
+    if (hmac && hmac->gen == carp->sig_gen &&
+        sig->counter == carp->carp_adv_counter) {
+        memcpy(ch->carp_md, sig->md, CARP_SIG_LEN);
+        carp->sig_head = (carp->sig_head + 1) % CARP_SIG_RING;
+        carp->sig_count--;
+        found = 1;
+    } else {
+        carp->sig_count = 0;
+    }
+    rcu_read_unlock();
+
+out:
+    if (carp->sig_ring && carp->sig_count <= CARP_SIG_RING / 2)
+        schedule_work(&carp->sig_work);
+    return found;
+}
+
+int carp_proto_sig_init(struct carp *carp)
+{
+    INIT_WORK(&carp->sig_work, carp_proto_sig_refill);
+
+    carp->sig_ring = kcalloc(CARP_SIG_RING, sizeof(struct carp_sig),
+                             GFP_KERNEL);
+    if (carp->sig_ring == NULL)
+        return -ENOMEM;
+
+    schedule_work(&carp->sig_work);
+    return 0;
+}
+
+/* Called from process context before the key is freed */
+void carp_proto_sig_free(struct carp *carp)
+{
+    struct carp_sig *ring = carp->sig_ring;
+
+    spin_lock_bh(&carp->adv_lock);
+    carp->sig_ring  = NULL;
+    carp->sig_count = 0;
+    spin_unlock_bh(&carp->adv_lock);
+
+    cancel_work_sync(&carp->sig_work);
+    kfree(ring);
+}
+
+/*
+ * Bundled advertisements. With bundling active on an interface, whichever
+ * of its vhids is due first sends one CARP_BUNDLE packet carrying every
+ * vhid the interface is master of, and the per-vhid advertisements are
+ * suppressed. A vhid that went out with a bundle less than half an interval
+ * ago sends nothing, so an interface sends one or two packets per interval
+ * however many nodes it hosts, while a vhid that just became master is
+ * announced at once. In auto mode bundles are only sent while a peer has
+ * been heard announcing CARP_AUTHLEN_BUNDLE within the last master down
+ * time; otherwise every vhid falls back to standard advertisements.
+ */
+static int carp_proto_bundle_active(struct carp *host)
+{
+    switch (host->bundle) {
+        case CARP_BUNDLE_ON:
+            return 1;
+        case CARP_BUNDLE_AUTO:
+            return host->bundle_until &&
+                   time_before(jiffies, host->bundle_until);
+        default:
+            return 0;
+    }
+}
+
+/* Called for every advertisement received; the line is only dirtied per tick */
+static void carp_proto_bundle_seen(struct carp *host)
+{
+    unsigned long until = jiffies +
+                          usecs_to_jiffies(ktime_to_us(host->md_timeout));
+
+    if (ACCESS_ONCE(host->bundle_until) != until)
+        host->bundle_until = until;
+}
+
+/* Called with the host's adv_lock held */
+static void carp_proto_bundle_add(struct sk_buff *skb, struct carp *carp,
+                                  ktime_t now)
+{
+    struct carp_bundle_entry *e;
+
+    carp->bundle_sent = now;
+
+    e = (struct carp_bundle_entry *)skb_put(skb, sizeof(*e));
+    e->vhid    = carp->vhid;
+    e->advskew = carp->advskew;
+    e->advbase = carp_wire_advbase(carp);
+    e->demote  = 0;
+}
+
+/*
+ * Build the bundle of the interface hosting carp into the host's
+ * preallocated bundle skb and return it with a reference held for the
+ * transmission, or return NULL. As with the template, a copy is only made
+ * while the driver still holds the previous bundle.
+ */
+static struct sk_buff *carp_proto_prepare_bundle(struct carp *host,
+                                                 struct carp *carp)
+{
+    struct sk_buff *skb = NULL;
+    struct carp_bundle *b;
+    struct carp_header *ch;
+    struct iphdr *ip;
+    struct carp *node;
+    ktime_t now = ktime_get();
+    int plen;
+
+    spin_lock_bh(&host->adv_lock);
+
+    /* nothing to do if the carp went out with a bundle just now */
+    if (ktime_to_ns(ktime_sub(now, carp->bundle_sent)) <
+        ktime_to_ns(carp->adv_timeout) / 2)
+        goto out_unlock;
+
+    skb = host->bundle_skb;
+    if (skb == NULL)
+        goto out_unlock;
+
+    if (skb_shared(skb)) {
+        skb = skb_copy_expand(skb, skb_headroom(skb), CARP_BUNDLE_ROOM,
+                              GFP_ATOMIC);
+        if (skb == NULL) {
+            host->cstat.mem_errors++;
+            goto out_unlock;
+        }
+        kfree_skb(host->bundle_skb);
+        host->bundle_skb = skb;
+    }
+
+    skb_trim(skb, CARP_ADV_LEN);
+    b = (struct carp_bundle *)skb_put(skb, sizeof(struct carp_bundle));
+
+    rcu_read_lock();
+    if (host->state == MASTER)
+        carp_proto_bundle_add(skb, host, now);
+    list_for_each_entry_rcu(node, &host->cold->nodes, node_entry)
+        if (node->state == MASTER)
+            carp_proto_bundle_add(skb, node, now);
+    rcu_read_unlock();
+
+    plen = skb_tail_pointer(skb) - (unsigned char *)b;
+    if (plen == sizeof(struct carp_bundle)) {
+        skb = NULL;
+        goto out_unlock;
+    }
+
+    host->bundle_counter++;
+    host->cstat.bundles_sent++;
+
+    ip = ip_hdr(skb);
+    ch = (struct carp_header *)skb_transport_header(skb);
+
+    ip->tot_len = htons(CARP_ADV_LEN - sizeof(struct ethhdr) + plen);
+    ip->id      = htons(host->bundle_counter & 0xffff);
+    ip_send_check(ip);
+
+    ch->carp_type       = CARP_BUNDLE;
+    ch->carp_counter[0] = htonl((host->bundle_counter >> 32) & 0xffffffff);
+    ch->carp_counter[1] = htonl(host->bundle_counter & 0xffffffff);
+    memcpy(b->counter, ch->carp_counter, sizeof(b->counter));
+
+    carp_crypto_hmac(host, (u8 *)b, plen, ch->carp_md);
+
+    ch->carp_cksum = 0;
+    ch->carp_cksum = ip_compute_csum(ch, sizeof(struct carp_header) + plen);
+
+    skb->dev = host->odev;
+    CARP_SKB_CB(skb)->carp    = carp;
+    skb_get(skb);
+
+out_unlock:
+    spin_unlock_bh(&host->adv_lock);
+    return skb;
+}
+
+/*
+ * Patch the template for the next advertisement of the carp and return it
+ * with a reference held for the transmission, or NULL if there is nothing
+ * to send.
+ */
+struct sk_buff *carp_proto_prepare_adv(struct carp *carp)
+{
+    struct carp_stat *cs = &carp->cstat;
+    struct sk_buff *skb;
+    struct iphdr *ip;
+    struct carp_header *ch;
+    __be16 id;
+
+    if (carp->state == BACKUP || !carp->odev)
+    	return NULL;
+
+    /* bowing out is always announced individually */
+    if (!carp->carp_bow_out && carp_proto_bundle_active(carp_host(carp)))
+        return carp_proto_prepare_bundle(carp_host(carp), carp);
+
+    //carp_dbg("%s: sending advertisement", carp->name);
+
+    spin_lock_bh(&carp->adv_lock);
+
+    skb = carp_proto_get_adv(carp);
+    if (!skb) {
+    	cs->mem_errors++;
+    	goto out_unlock;
+    }
+
+    ip = ip_hdr(skb);
+    ch = (struct carp_header *)skb_transport_header(skb);
+
+    id = htons(ntohs(ip->id) + 1);
+    csum_replace2(&ip->check, ip->id, id);
+    ip->id = id;
+
+    carp->carp_adv_counter++;
+
+    if (carp->carp_bow_out) {
+        ch->carp_advbase = 255;
+        ch->carp_advskew = 255;
+    } else {
+        ch->carp_advbase = carp_wire_advbase(carp);
+        ch->carp_advskew = carp->advskew;
+    }
+
+    ch->carp_counter[0] = htonl((carp->carp_adv_counter >> 32) & 0xffffffff);
+    ch->carp_counter[1] = htonl(carp->carp_adv_counter & 0xffffffff);
+
+    /* nodes have no ring and always sign inline, that is not a miss */
+    if (carp->sig_ring == NULL) {
+        carp_hmac_sign(carp, ch);
+    } else if (!carp_proto_sig_pop(carp, ch)) {
+        cs->sig_misses++;
+        carp_hmac_sign(carp, ch);
+    }
+
+    /* Calculate the CARP packets checksum */
+    ch->carp_cksum = 0;
+    ch->carp_cksum = ip_compute_csum(ch, sizeof(struct carp_header));
+
+    //dump_carp_header(ch);
+
+    skb->dev = carp->odev;
+    CARP_SKB_CB(skb)->carp    = carp;
+    skb_get(skb);
+
+out_unlock:
+    spin_unlock_bh(&carp->adv_lock);
+    return skb;
+}
+
+/* Adopt the peer's counter. Called with carp->lock held. */
+static void carp_proto_set_counter(struct carp *carp, u64 counter)
+{
+    spin_lock_bh(&carp->adv_lock);
+    carp->carp_adv_counter = counter;
+    carp->sig_count = 0;
+    if (carp->sig_ring)
+        schedule_work(&carp->sig_work);
+    spin_unlock_bh(&carp->adv_lock);
+}
+
+/*
+ * Unicast peers, in the manner of OpenBSD's carppeer. When a carp interface
+ * has peers, its advertisements and those of its nodes are sent to each of
+ * them instead of to the multicast group, and advertisements from any other
+ * source are dropped. Unicast needs a route and a neighbour, so these go
+ * through ip_local_out() rather than straight to the driver. The peer list
+ * is modified under RTNL and walked under RCU.
+ */
+static struct carp_peer *carp_proto_peer_find(struct carp *carp, __be32 addr)
+{
+    struct carp_peer *peer;
+
+    list_for_each_entry_rcu(peer, &carp->cold->peers, entry)
+        if (peer->addr == addr)
+            return peer;
+    return NULL;
+}
+
+int carp_proto_peer_add(struct carp *carp, __be32 addr)
+{
+    struct carp_peer *peer;
+
+    ASSERT_RTNL();
+
+    if (ipv4_is_multicast(addr) || ipv4_is_zeronet(addr) ||
+        ipv4_is_lbcast(addr))
+        return -EINVAL;
+
+    if (carp_proto_peer_find(carp, addr))
+        return -EEXIST;
+
+    if (carp->cold->npeers >= CARP_MAX_PEERS)
+        return -ENOSPC;
+
+    peer = kzalloc(sizeof(struct carp_peer), GFP_KERNEL);
+    if (peer == NULL)
+        return -ENOMEM;
+
+    peer->addr = addr;
+    list_add_tail_rcu(&peer->entry, &carp->cold->peers);
+    carp->cold->npeers++;
+    return 0;
+}
+
+int carp_proto_peer_del(struct carp *carp, __be32 addr)
+{
+    struct carp_peer *peer;
+
+    ASSERT_RTNL();
+
+    peer = carp_proto_peer_find(carp, addr);
+    if (peer == NULL)
+        return -ENOENT;
+
+    list_del_rcu(&peer->entry);
+    carp->cold->npeers--;
+    kfree_rcu(peer, rcu);
+    return 0;
+}
+
+/* Called from ndo_uninit under RTNL */
+void carp_proto_peer_flush(struct carp *carp)
+{
+    struct carp_peer *peer, *tmp;
+
+    list_for_each_entry_safe(peer, tmp, &carp->cold->peers, entry) {
+        list_del_rcu(&peer->entry);
+        kfree_rcu(peer, rcu);
+    }
+    carp->cold->npeers = 0;
+}
+
+/* Called under rcu_read_lock */
+int carp_proto_peer_ok(struct carp *carp, __be32 saddr)
+{
+    return list_empty(&carp->cold->peers) ||
+           carp_proto_peer_find(carp, saddr) != NULL;
+}
+
+/*
+ * Send a copy of the prepared advertisement to each peer of the carp and
+ * release it. Called under rcu_read_lock, with BHs disabled.
+ */
+static void carp_proto_xmit_peers(struct carp *carp, struct sk_buff *skb)
+{
+    /* the carpdev the skb was prepared for; carp->odev may be gone by now */
+    struct net_device *odev = skb->dev;
+    struct net *net = dev_net(odev);
+    struct carp_peer *peer;
+    struct sk_buff *nskb;
+    struct iphdr *ip;
+    struct rtable *rt;
+    struct flowi4 fl4;
+    unsigned int len;
+
+    list_for_each_entry_rcu(peer, &carp->cold->peers, entry) {
+        ip = ip_hdr(skb);
+        rt = ip_route_output_ports(net, &fl4, NULL, peer->addr, ip->saddr,
+                                   0, 0, IPPROTO_CARP, RT_TOS(ip->tos),
+                                   odev->ifindex);
+        if (IS_ERR(rt)) {
+            carp->cstat.xmit_errors++;
+            continue;
+        }
+
+        nskb = skb_copy(skb, GFP_ATOMIC);
+        if (nskb == NULL) {
+            ip_rt_put(rt);
+            carp->cstat.mem_errors++;
+            continue;
+        }
+
+        /* the control block holds CARP_SKB_CB, not IPCB */
+        memset(IPCB(nskb), 0, sizeof(struct inet_skb_parm));
+        skb_pull(nskb, skb_network_offset(nskb));
+        skb_dst_set(nskb, &rt->dst);
+        nskb->pkt_type = PACKET_OUTGOING;
+
+        ip = ip_hdr(nskb);
+        ip->daddr = peer->addr;
+        len = nskb->len;
+
+        /* ip_local_out() fills in tot_len and the header checksum */
+        if (net_xmit_eval(ip_local_out(nskb)))
+            carp->cstat.xmit_errors++;
+        else
+            carp->cstat.bytes_sent += len;
+    }
+
+    kfree_skb(skb);
+}
+
+/*
+ * Hand a list of prepared advertisements to the lower device, taking its
+ * TX lock only once for the whole list. The driver is called directly,
+ * without going through dev_queue_xmit(), so the advertisements are not
+ * seen by packet taps (tcpdump) on the carpdev; the core does not export
+ * its tap delivery to modules on the kernels this is built for. Peers see
+ * them as usual, and they show in the Bytes Sent counter.
+ *
+ * Advertisements always use the last TX queue of the device. The queue is
+ * fixed, not reserved: a module has no say in the carpdev's own queue
+ * selection, so other flows may hash onto it as well. If it is stopped the
+ * advertisement is retried fresh shortly after, see carp_port_defer_adv().
+ */
+void carp_proto_xmit_list(struct carp_port *port, struct sk_buff_head *list)
+{
+    struct net_device *odev = port->dev;
+    const struct net_device_ops *ops = odev->netdev_ops;
+    struct netdev_queue *txq;
+    struct sk_buff *skb, *tmp;
+    struct carp *carp;
+    unsigned int len;
+    netdev_tx_t ret;
+    u16 queue;
+
+    queue = odev->real_num_tx_queues - 1;
+    txq   = netdev_get_tx_queue(odev, queue);
+
+    local_bh_disable();
+
+    /* advertisements of carps with unicast peers take the IP stack */
+    rcu_read_lock();
+    skb_queue_walk_safe(list, skb, tmp) {
+        carp = CARP_SKB_CB(skb)->carp;
+        if (list_empty(&carp->cold->peers))
+            continue;
+        __skb_unlink(skb, list);
+        carp_proto_xmit_peers(carp, skb);
+    }
+    rcu_read_unlock();
+
+    /* a bow-out sent while the carpdev goes down has nowhere to go */
+    if (unlikely(!netif_running(odev))) {
+        __skb_queue_purge(list);
+        local_bh_enable();
+        return;
+    }
+
+    __netif_tx_lock(txq, smp_processor_id());
+    while ((skb = __skb_dequeue(list)) != NULL) {
+        carp = CARP_SKB_CB(skb)->carp;
+        len  = skb->len;
+
+        if (netif_xmit_frozen_or_stopped(txq)) {
+            carp_port_defer_adv(port, skb);
+            continue;
+        }
+
+        skb_set_queue_mapping(skb, queue);
+        ret = ops->ndo_start_xmit(skb, odev);
+        if (ret == NETDEV_TX_BUSY || ret == NETDEV_TX_LOCKED) {
+            carp_port_defer_adv(port, skb);
+            continue;
+        }
+        if (ret != NETDEV_TX_OK) {
+            carp->cstat.xmit_errors++;
+            carp_dbg("Hard xmit error.\n");
+            continue;
+        }
 
-#include "carp.h"
-#include "carp_log.h"
+        txq_trans_update(txq);
+        if (carp->adv_retries) {
+            carp->adv_retries = 0;
+            carp->cstat.adv_retried++;
+        }
+        carp->cstat.bytes_sent += len;
+    }
+    __netif_tx_unlock(txq);
+    local_bh_enable();
+}
+
+/*
+ * Send an advertisement right away, outside of the port's schedule. The
+ * next one is scheduled first, so that a retry can pull it in.
+ */
+void carp_proto_adv(struct carp *carp)
+{
+    struct carp_port *port;
+    struct sk_buff_head list;
+    struct sk_buff *skb;
+
+    if (!carp->carp_bow_out && carp->state != BACKUP)
+        carp_port_schedule_adv(carp, carp->adv_timeout);
+
+    skb = carp_proto_prepare_adv(carp);
+    if (skb) {
+        __skb_queue_head_init(&list);
+        __skb_queue_tail(&list, skb);
+
+        /* the owner tasklet may race with the carp leaving its port */
+        rcu_read_lock();
+        port = rcu_dereference(carp->port);
+        if (port)
+            carp_proto_xmit_list(port, &list);
+        else
+            __skb_queue_purge(&list);
+        rcu_read_unlock();
+    }
+}
 
-static int carp_proto_rcv(struct carp_header *);
+static void carp_proto_err(struct sk_buff *skb, u32 info)
+{
+    carp_dbg("%s\n", __func__);
+    kfree_skb(skb);
+}
 
-static unsigned short cksum(const void * const buf_, const size_t len)
+/*
+ * Token bucket rate limiting of received advertisements, per source address
+ * and vhid, applied before the HMAC is verified. The entries live in a table
+ * of the port, hashed with a random seed of the port so that a sender cannot
+ * pick sources that land in the bucket of a legitimate one, and each entry
+ * matches its source and vhid exactly, so sources never share tokens. An
+ * entry stays while its source has been heard within the master down time
+ * of the carp; a new source finding every way of its bucket in use is
+ * dropped rather than evicting a source that is still advertising.
+ *
+ * Tokens are counted in 1/HZ of an advertisement, each advertisement costs
+ * HZ tokens and rx_rate * elapsed jiffies are added back.
+ */
+static int carp_proto_rate_check(struct carp *carp, __be32 saddr)
 {
-    const unsigned char *buf = (unsigned char *) buf_;
-    unsigned long sum = 0UL;
-    size_t evenlen = len & ~ (size_t) 1U;
-    size_t i = (size_t) 0U;
+    struct carp_port *port = rcu_dereference(carp->port);
+    struct carp_rl_bucket *b;
+    struct carp_rl_entry *e, *free = NULL;
+    unsigned long now = jiffies, elapsed, idle;
+    u32 rate = carp->rx_rate, cap;
+    int i, ok = 1;
+
+    if (rate == 0 || port == NULL)
+        return 1;
+
+    cap  = carp->rx_burst * HZ;
+    idle = max_t(unsigned long, HZ,
+                 nsecs_to_jiffies(ktime_to_ns(carp->md_timeout)));
+    b = &port->rl[jhash_2words((__force u32)saddr, carp->vhid,
+                               port->rl_seed) & (CARP_RL_BUCKETS - 1)];
+
+    spin_lock(&b->lock);
+
+    for (i = 0; i < CARP_RL_WAYS; i++) {
+        e = &b->ways[i];
+        if (e->vhid == carp->vhid && e->saddr == saddr)
+            goto found;
+        if (free == NULL && (e->vhid == 0 || time_after(now, e->stamp + idle)))
+            free = e;
+    }
 
-    if (len <= (size_t) 0U) {
-        return 0U;
+    if (free == NULL) {
+        ok = 0;
+        goto out_unlock;
     }
-    do {
-        sum += (buf[i] << 8) | buf[i + 1];
-        if (sum > 0xffff) {
-            sum &= 0xffff;
-            sum++;
-        }
-        i += 2;
-    } while (i < evenlen);
-    if (i != evenlen) {
-        sum += buf[i] << 8;
-        if (sum > 0xffff) {
-            sum &= 0xffff;
-            sum++;
-        }
+
+    e = free;
+    e->saddr  = saddr;
+    e->vhid   = carp->vhid;
+    e->tokens = cap;
+    e->stamp  = now;
+
+found:
+    elapsed = now - e->stamp;
+    if (elapsed) {
+        if (elapsed > cap / rate + 1)
+            e->tokens = cap;
+        else
+            e->tokens = min(cap, e->tokens + (u32)elapsed * rate);
     }
-    return (unsigned short) ~sum;
+    e->stamp = now;
+
+    if (e->tokens >= HZ)
+        e->tokens -= HZ;
+    else
+        ok = 0;
+
+out_unlock:
+    spin_unlock(&b->lock);
+
+    return ok;
 }
 
-/*----------------------------- Crypto functions ----------------------------*/
-int carp_crypto_hmac(struct carp *carp, struct scatterlist *sg, u8 *carp_md)
+/*
+ * Received advertisements go through a pipeline of checks ordered from the
+ * cheapest to the most expensive, so that garbage is dropped before it
+ * costs a lookup, a checksum or an HMAC. Each stage has its own counter.
+ * Drops before the vhid is known are accounted to the namespace.
+ */
+static int carp_proto_rcv_ip4(struct sk_buff *skb)
 {
-    int res;
-    struct hash_desc desc;
+    struct carp_net *cn = net_generic(dev_net(skb->dev), carp_net_id);
+    struct carp_header *carp_hdr;
+    struct carp *carp;
+    __be32 saddr;
 
-    res = crypto_hash_setkey(carp->hash, carp->carp_key, sizeof(carp->carp_key));
-    if (res)
-        return res;
+    //carp_dbg("carp: received packet (saddr=%pI4)\n", &(ip_hdr(skb)->saddr));
+
+    if (!pskb_may_pull(skb, sizeof(struct carp_header))) {
+        this_cpu_inc(cn->stat->len_errors);
+        goto err_out_skb_drop;
+    }
 
-    desc.tfm   = carp->hash;
-    desc.flags = 0;
+    /* the pull may have moved the headers */
+    if (ip_hdr(skb)->ttl != CARP_TTL) {
+        this_cpu_inc(cn->stat->ttl_errors);
+        goto err_out_skb_drop;
+    }
 
-    res = crypto_hash_digest(&desc, sg, sg->length, carp_md);
-    if (res);
-        return res;
+    carp_hdr = (struct carp_header *)skb->data;
+
+    if (carp_hdr->carp_version != CARP_VERSION) {
+        carp_dbg("carp: version mismatch: remote=%d, local=%d.\n",
+                 carp_hdr->carp_version, CARP_VERSION);
+        carp = carp_get_by_vhid(skb->dev, carp_hdr->carp_vhid);
+        if (carp)
+            atomic_inc(&carp->cstat.ver_errors);
+        else
+            this_cpu_inc(cn->stat->ver_errors);
+        goto err_out_skb_drop;
+    }
+
+    if (carp_hdr->carp_type == CARP_BUNDLE) {
+        /* the payload must be linear for the HMAC */
+        if (skb->len < sizeof(struct carp_header) + sizeof(struct carp_bundle) ||
+            (skb->len - sizeof(struct carp_header) -
+             sizeof(struct carp_bundle)) % sizeof(struct carp_bundle_entry) ||
+            !pskb_may_pull(skb, skb->len)) {
+            this_cpu_inc(cn->stat->len_errors);
+            goto err_out_skb_drop;
+        }
+        carp_hdr = (struct carp_header *)skb->data;
+    } else if (carp_hdr->carp_type != CARP_ADVERTISEMENT) {
+        this_cpu_inc(cn->stat->type_errors);
+        goto err_out_skb_drop;
+    }
+
+    carp = carp_get_by_vhid(skb->dev, carp_hdr->carp_vhid);
+    if (carp == NULL) {
+        this_cpu_inc(cn->stat->vhid_errors);
+        goto err_out_skb_drop;
+    }
+
+    if (skb_checksum_complete(skb)) {
+        atomic_inc(&carp->cstat.crc_errors);
+        goto err_out_skb_drop;
+    }
+
+    saddr = ip_hdr(skb)->saddr;
+
+    if (!carp_proto_peer_ok(carp, saddr)) {
+        atomic_inc(&carp->cstat.peer_drops);
+        goto err_out_skb_drop;
+    }
+
+    if (!carp_proto_rate_check(carp, saddr)) {
+        atomic_inc(&carp->cstat.rate_drops);
+        goto err_out_skb_drop;
+    }
+
+    if (carp_hdr->carp_type == CARP_BUNDLE) {
+        carp_proto_rcv_bundle(carp, skb);
+        goto err_out_skb_drop;
+    }
+
+    if (carp_verify_batch) {
+        carp_proto_verify_queue(skb);
+        return 0;
+    }
+
+    carp_proto_rcv(carp, carp_hdr);
+
+err_out_skb_drop:
+    kfree_skb(skb);
 
     return 0;
 }
 
-static void carp_hmac_sign(struct carp *carp, struct carp_header *carp_hdr)
+/*
+ * The election state machine of a carp is only ever run by its owner
+ * tasklet. The receive path, which may run on many CPUs at once, verifies
+ * the advertisement and publishes it as a compact sample without taking
+ * carp->lock; the owner picks up the latest sample and applies the
+ * transitions. Master down timer expiries are delivered to the owner the
+ * same way, so the state machine has a single writer besides the
+ * configuration paths.
+ */
+#define CARP_SAMPLE_VALID   (1U << 31)
+
+#define carp_sample_make(demote, advbase, advskew) \
+    (CARP_SAMPLE_VALID | ((demote) << 16) | ((advbase) << 8) | (advskew))
+
+static inline u32 carp_sample_pack(struct carp_header *carp_hdr)
 {
-    struct scatterlist sg;
-    sg_set_buf(&sg, carp_hdr->carp_counter, sizeof(carp_hdr->carp_counter));
-    carp_crypto_hmac(carp, &sg, carp_hdr->carp_md);
+    return carp_sample_make(carp_hdr->carp_demote, carp_hdr->carp_advbase,
+                            carp_hdr->carp_advskew);
 }
 
-static int carp_hmac_verify(struct carp *carp, struct carp_header *carp_hdr)
-{
-    u8 tmp_md[CARP_SIG_LEN];
-    struct scatterlist sg;
-    int res;
+#define carp_sample_advskew(s)  ((s) & 0xff)
+#define carp_sample_advbase(s)  (((s) >> 8) & 0xff)
+#define carp_sample_demote(s)   (((s) >> 16) & 0xff)
 
-    sg_set_buf(&sg, carp_hdr->carp_counter, sizeof(carp_hdr->carp_counter));
-    memset(tmp_md, 1, sizeof(tmp_md));
+static inline u64 carp_counter_get(const u32 *counter)
+{
+    u64 tmp_counter;
 
-    res = carp_crypto_hmac(carp, &sg, tmp_md);
-    if (res)
-        return res;
+    tmp_counter = ntohl(counter[0]);
+    tmp_counter = tmp_counter<<32;
+    tmp_counter += ntohl(counter[1]);
+    return tmp_counter;
+}
 
-    return memcmp(tmp_md, carp_hdr->carp_md, CARP_SIG_LEN);
+/*
+ * Receive paths on several CPUs may publish for the same carp. The sample
+ * and its counter go out in a single store so the tasklet never pairs one
+ * advertisement's sample with another's counter.
+ */
+static void carp_proto_publish_sample(struct carp *carp, u64 counter,
+                                      u32 sample)
+{
+    atomic64_set(&carp->rx_sample,
+                 ((u64)sample << 32) | lower_32_bits(counter));
+    tasklet_schedule(&carp->owner);
 }
 
-/*----------------------------- Proto  functions ----------------------------*/
-void carp_proto_adv(struct carp *carp)
+/*
+ * Whether an authenticated advertisement runs the same kind of interval as
+ * the carp, and in millisecond mode the same interval. Peers that disagree
+ * would each compute a different master down time and elect wrongly, so
+ * their advertisements are dropped and counted. Bow-outs always pass.
+ */
+static int carp_proto_interval_ok(struct carp *carp, u8 authlen, u8 advbase,
+                                  u8 advskew)
 {
-    //struct carp_header *ch = &carp->hdr;
-    struct carp_stat *cs = &carp->cstat;
-    struct sk_buff *skb;
-    int len;
-    unsigned short sum;
-    struct ethhdr *eth;
-    struct iphdr *ip;
-    struct carp_header *ch;
+    int msec = (authlen & CARP_AUTHLEN_MSEC) != 0;
 
-    if (carp->state == BACKUP || !carp->odev)
-    	return;
+    if (advbase == 255 && advskew == 255)
+        return 1;
 
-    //carp_dbg("%s: sending advertisement", carp->name);
+    if (msec == (carp->adv_msec != 0) &&
+        (!msec || advbase == carp->adv_msec))
+        return 1;
 
-    len = sizeof(struct iphdr) + sizeof(struct carp_header) + sizeof(struct ethhdr);
+    atomic_inc(&carp->cstat.interval_errors);
+    if (msec)
+        net_warn_ratelimited("%s: peer advertises %u ms intervals, "
+                             "local %u ms\n", carp->name, advbase,
+                             carp->adv_msec);
+    else
+        net_warn_ratelimited("%s: peer advertises second intervals, "
+                             "local %u ms\n", carp->name, carp->adv_msec);
+    return 0;
+}
 
-    skb = alloc_skb(len + 2, GFP_ATOMIC);
-    if (!skb) {
-    	cs->mem_errors++;
-    	goto out;
-    }
+/* Hand an authenticated advertisement over to the owner tasklet */
+static void carp_proto_publish(struct carp *carp, struct carp_header *carp_hdr)
+{
+    if (!carp_proto_interval_ok(carp, carp_hdr->carp_authlen,
+                                carp_hdr->carp_advbase,
+                                carp_hdr->carp_advskew))
+        return;
 
-    skb_reserve(skb, 16);
-    eth = (struct ethhdr *) skb_push(skb, 14);
-    ip = (struct iphdr *)skb_put(skb, sizeof(struct iphdr));
-    ch = (struct carp_header *)skb_put(skb, sizeof(struct carp_header));
+    if (carp_hdr->carp_authlen & CARP_AUTHLEN_BUNDLE)
+        carp_proto_bundle_seen(carp_host(carp));
 
-    memset(&(IPCB(skb)->opt), 0, sizeof(IPCB(skb)->opt));
+    carp_proto_publish_sample(carp, carp_counter_get(carp_hdr->carp_counter),
+                              carp_sample_pack(carp_hdr));
+}
 
-    ip_eth_mc_map(carp->iph.daddr, eth->h_dest);
-    memcpy(eth->h_source, carp->odev->dev_addr, ETH_ALEN);
-    eth->h_proto 	= htons(ETH_P_IP);
+/*
+ * Fan a bundle out to the carps of the receiving interface. The carp the
+ * header's vhid maps to provides the key; entries for vhids hosted by
+ * another interface on the same lower device are ignored.
+ */
+static void carp_proto_rcv_bundle(struct carp *carp, struct sk_buff *skb)
+{
+    struct carp_header *carp_hdr = (struct carp_header *)skb->data;
+    struct carp_bundle *b = (struct carp_bundle *)(carp_hdr + 1);
+    struct carp_bundle_entry *e;
+    struct carp *c;
+    u8 md[CARP_SIG_LEN];
+    unsigned int i, n, plen;
+    u64 counter;
+
+    plen = skb->len - sizeof(struct carp_header);
+    n = (plen - sizeof(struct carp_bundle)) / sizeof(struct carp_bundle_entry);
+
+    if (memcmp(b->counter, carp_hdr->carp_counter, sizeof(b->counter)) ||
+        carp_crypto_hmac(carp, (u8 *)b, plen, md) ||
+        memcmp(md, carp_hdr->carp_md, CARP_SIG_LEN)) {
+        carp_dbg("%s: HMAC mismatch on received bundle.\n", carp->name);
+        atomic_inc(&carp->cstat.hmac_errors);
+        return;
+    }
 
-    ip->ihl      = 5;
-    ip->version  = 4;
-    ip->tos      = IPTOS_LOWDELAY;
-    ip->tot_len  = htons(len - sizeof(struct ethhdr));
-    ip->frag_off = 0;
-    ip->ttl      = CARP_TTL;
-    ip->protocol = IPPROTO_CARP;
-    ip->check    = 0;
-    ip->saddr    = carp->iph.saddr;
-    ip->daddr    = carp->iph.daddr;
-    get_random_bytes(&ip->id, 2);
-    ip_send_check(ip);
+    atomic_inc(&carp->cstat.bundles_rcvd);
+    carp_proto_bundle_seen(carp_host(carp));
+    counter = carp_counter_get(carp_hdr->carp_counter);
 
-    spin_lock(&carp->lock);
-    carp->carp_adv_counter++;
-    spin_unlock(&carp->lock);
+    for (i = 0; i < n; i++) {
+        e = &b->entries[i];
+        c = carp_get_by_vhid(skb->dev, e->vhid);
+        if (c == NULL || c->dev != carp->dev)
+            continue;
 
-    ch->carp_type    = CARP_ADVERTISEMENT;
-    ch->carp_version = CARP_VERSION;
-    ch->carp_demote  = 0;
-    ch->carp_authlen = 7;
-    ch->carp_vhid    = carp->vhid;
+        if (!carp_proto_interval_ok(c, carp_hdr->carp_authlen, e->advbase,
+                                    e->advskew))
+            continue;
 
-    if (carp->carp_bow_out) {
-        ch->carp_advbase = 255;
-        ch->carp_advskew = 255;
-    } else {
-        ch->carp_advbase = carp->advbase;
-        ch->carp_advskew = carp->advskew;
+        carp_proto_publish_sample(c, counter,
+                                  carp_sample_make(e->demote, e->advbase,
+                                                   e->advskew));
     }
+}
 
-    ch->carp_counter[0] = htonl((carp->carp_adv_counter >> 32) & 0xffffffff);
-    ch->carp_counter[1] = htonl(carp->carp_adv_counter & 0xffffffff);
+static int carp_proto_rcv(struct carp *carp, struct carp_header *carp_hdr)
+{
+    //dump_carp_header(carp_hdr);
+
+    /* verify the hash */
+    if (carp_hmac_verify(carp, carp_hdr)) {
+    	carp_dbg("%s: HMAC mismatch on received advertisement.\n", carp->name);
+    	atomic_inc(&carp->cstat.hmac_errors);
+    	return 0;
+    }
 
-    carp_hmac_sign(carp, ch);
+    carp_proto_publish(carp, carp_hdr);
+    return 0;
+}
 
-    /* Calculate the CARP packets checksum */
-    ch->carp_cksum = 0;
-    sum = cksum(ch, sizeof(struct carp_header));
-    ch->carp_cksum = htons(sum);
+/*
+ * Batched verification. With verify_batch set, advertisements that passed
+ * the cheap checks are queued on a per-CPU batch instead of being hashed
+ * one at a time in the receive path. The batch is drained by a tasklet at
+ * the end of the current softirq run, or inline as soon as it holds
+ * verify_batch packets, which bounds the latency added to any one packet.
+ * A batch of one is verified synchronously; larger batches are submitted
+ * to the ahash transform all at once so an async driver can work on them
+ * in parallel. Each queued skb holds a reference on its lower device.
+ * An async driver may complete in hard interrupt context, so completed
+ * requests are handed back to the tasklet to be finished in softirq.
+ */
+struct carp_verify_batch {
+    struct sk_buff_head   queue;
+    struct tasklet_struct tasklet;
+    spinlock_t            done_lock;
+    struct list_head      done;
+};
 
-    //dump_carp_header(ch);
+static DEFINE_PER_CPU(struct carp_verify_batch, carp_verify_batches);
 
-    //memcpy(c, ch, sizeof(struct carp_header));
+struct carp_verify_req {
+    struct sk_buff        *skb;
+    struct carp_hmac      *hmac;
+    struct list_head      done_entry;
+    int                   err;
+    struct scatterlist    sg;
+    u8                    md[CARP_AUTH_MAX_DIGEST];
+    struct ahash_request  req;      /* must be last */
+};
 
-    skb->protocol   = __constant_htons(ETH_P_IP);
-    skb->mac_header = (void *)eth;
-    skb->dev        = carp->odev;
-    skb->pkt_type   = PACKET_MULTICAST;
+/*
+ * The carp a queued advertisement is for. Looked up again at every step
+ * rather than remembered, so that carp nodes can go away while
+ * advertisements for them are queued. Called under rcu_read_lock.
+ */
+static struct carp *carp_proto_verify_carp(struct sk_buff *skb)
+{
+    struct carp_header *carp_hdr = (struct carp_header *)skb->data;
+
+    return carp_get_by_vhid(skb->dev, carp_hdr->carp_vhid);
+}
+
+static void carp_proto_verify_finish(struct carp_verify_req *vr, int err)
+{
+    struct sk_buff *skb = vr->skb;
+    struct carp_header *carp_hdr = (struct carp_header *)skb->data;
+    struct carp *carp;
 
-    netif_tx_lock(carp->odev);
-    if (!netif_queue_stopped(carp->odev))
-    {
-    	atomic_inc(&skb->users);
+    rcu_read_lock();
+    carp = carp_proto_verify_carp(skb);
 
-    	if (carp->odev->netdev_ops->ndo_start_xmit(skb, carp->odev))
-    	{
-    		atomic_dec(&skb->users);
-    		cs->xmit_errors++;
-    		carp_dbg("Hard xmit error.\n");
-    	}
-    	cs->bytes_sent += len;
+    /* the vhid may have been rekeyed or reassigned in the meantime */
+    if (carp == NULL || rcu_access_pointer(carp->hmac) != vr->hmac)
+        goto out_unlock;
+
+    if (err || memcmp(vr->md, carp_hdr->carp_md, CARP_SIG_LEN)) {
+        carp_dbg("%s: HMAC mismatch on received advertisement.\n", carp->name);
+        atomic_inc(&carp->cstat.hmac_errors);
+    } else {
+        atomic_inc(&carp->cstat.verify_async);
+        carp_proto_publish(carp, carp_hdr);
     }
-    netif_tx_unlock(carp->odev);
 
-    if (!carp->carp_bow_out)
-        mod_timer(&carp->adv_timer, jiffies + carp->adv_timeout);
+out_unlock:
+    rcu_read_unlock();
 
+    carp_hmac_put(vr->hmac);
+    dev_put(skb->dev);
     kfree_skb(skb);
-out:
-    return;
+    kfree(vr);
 }
 
-static void carp_proto_err(struct sk_buff *skb, u32 info)
+/* May be called in any context, including hard interrupts */
+static void carp_proto_verify_done(struct crypto_async_request *areq, int err)
 {
-    carp_dbg("%s\n", __func__);
+    struct carp_verify_req *vr = areq->data;
+    struct carp_verify_batch *batch;
+    unsigned long flags;
+
+    /* a backlogged request has been started, it completes later */
+    if (err == -EINPROGRESS)
+        return;
+
+    vr->err = err;
+
+    batch = &get_cpu_var(carp_verify_batches);
+    spin_lock_irqsave(&batch->done_lock, flags);
+    list_add_tail(&vr->done_entry, &batch->done);
+    spin_unlock_irqrestore(&batch->done_lock, flags);
+    tasklet_schedule(&batch->tasklet);
+    put_cpu_var(carp_verify_batches);
+}
+
+static void carp_proto_verify_sync(struct sk_buff *skb)
+{
+    struct carp *carp;
+
+    rcu_read_lock();
+    carp = carp_proto_verify_carp(skb);
+    if (carp)
+        carp_proto_rcv(carp, (struct carp_header *)skb->data);
+    rcu_read_unlock();
+
+    dev_put(skb->dev);
     kfree_skb(skb);
 }
 
-static int carp_proto_rcv_ip4(struct sk_buff *skb)
+static void carp_proto_verify_async(struct sk_buff *skb)
 {
-    int err = 0;
-    struct iphdr *iph;
-    struct carp_header *carp_hdr;
+    struct carp_header *carp_hdr = (struct carp_header *)skb->data;
+    struct carp_verify_req *vr;
+    struct carp_hmac *hmac = NULL;
+    struct carp *carp;
+    int res;
 
-    iph = ip_hdr(skb);
-    //carp_dbg("carp: received packet (saddr=%pI4)\n", &(iph->saddr));
+    rcu_read_lock();
+    carp = carp_proto_verify_carp(skb);
+    if (carp)
+        hmac = carp_hmac_get(carp);
+    rcu_read_unlock();
 
-    // TODO: implement greater packet verification checks here
+    if (hmac == NULL || hmac->atfm == NULL)
+        goto sync;
 
-    carp_hdr = (struct carp_header *)skb->data;
+    vr = kmalloc(sizeof(*vr) + crypto_ahash_reqsize(hmac->atfm), GFP_ATOMIC);
+    if (vr == NULL)
+        goto sync;
 
-    // TODO: add CARP checksum verification here
+    vr->skb  = skb;
+    vr->hmac = hmac;
+    sg_init_one(&vr->sg, carp_hdr->carp_counter, sizeof(carp_hdr->carp_counter));
 
-    err = carp_proto_rcv(carp_hdr);
+    ahash_request_set_tfm(&vr->req, hmac->atfm);
+    ahash_request_set_callback(&vr->req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+                               carp_proto_verify_done, vr);
+    ahash_request_set_crypt(&vr->req, &vr->sg, vr->md,
+                            sizeof(carp_hdr->carp_counter));
 
-err_out_skb_drop:
-    kfree_skb(skb);
+    res = crypto_ahash_digest(&vr->req);
+    if (res == -EINPROGRESS || res == -EBUSY)
+        return;
 
-    return err;
+    carp_proto_verify_finish(vr, res);
+    return;
+
+sync:
+    carp_hmac_put(hmac);
+    carp_proto_verify_sync(skb);
 }
 
-static int carp_proto_rcv(struct carp_header *carp_hdr)
+static void carp_proto_verify_flush(unsigned long data)
 {
-    int err = 0;
-    struct carp *carp;
-    u64 tmp_counter;
-    struct timeval c_tv, ch_tv;
+    struct carp_verify_batch *batch = (struct carp_verify_batch *)data;
+    struct carp_verify_req *vr, *tmp;
+    struct sk_buff_head list;
+    struct sk_buff *skb;
+    LIST_HEAD(done);
 
-    carp = carp_get_by_vhid(carp_hdr->carp_vhid);
-    if (carp == NULL)
-        return err;
+    spin_lock_irq(&batch->done_lock);
+    list_splice_init(&batch->done, &done);
+    spin_unlock_irq(&batch->done_lock);
 
-    //dump_carp_header(carp_hdr);
+    list_for_each_entry_safe(vr, tmp, &done, done_entry)
+        carp_proto_verify_finish(vr, vr->err);
 
-    spin_lock(&carp->lock);
+    __skb_queue_head_init(&list);
+    skb_queue_splice_init(&batch->queue, &list);
 
-    if (carp_hdr->carp_version != CARP_VERSION) {
-    	carp_dbg("%s: version mismatch: remote=%d, local=%d.\n",
-    		carp->name, carp_hdr->carp_version, CARP_VERSION);
-    	carp->cstat.ver_errors++;
-    	goto err_out;
+    if (skb_queue_len(&list) == 1) {
+        carp_proto_verify_sync(__skb_dequeue(&list));
+        return;
     }
 
-    /* verify the hash */
-    if (carp_hmac_verify(carp, carp_hdr)) {
-    	carp_dbg("%s: HMAC mismatch on received advertisement.\n", carp->name);
-    	carp->cstat.hmac_errors++;
-    	goto err_out;
+    while ((skb = __skb_dequeue(&list)) != NULL)
+        carp_proto_verify_async(skb);
+}
+
+/* Called from softirq; takes ownership of the skb */
+static void carp_proto_verify_queue(struct sk_buff *skb)
+{
+    struct carp_verify_batch *batch = &__get_cpu_var(carp_verify_batches);
+
+    dev_hold(skb->dev);
+    __skb_queue_tail(&batch->queue, skb);
+
+    if (skb_queue_len(&batch->queue) >= carp_verify_batch)
+        carp_proto_verify_flush((unsigned long)batch);
+    else
+        tasklet_schedule(&batch->tasklet);
+}
+
+/*
+ * Election policy. Another module can register a hook that takes part in
+ * every election with signals of its own (queue depth, load, backends).
+ * There is at most one; it is published under RCU and an unregistering
+ * module waits for running elections to finish. Without one, the election
+ * is the plain advbase/advskew comparison and costs a single pointer test.
+ *
+ * A policy that changes the local parameters or decides on its own should
+ * keep the hosts of the cluster consistent, typically by also changing the
+ * advertised advskew, or both ends may claim the vhid.
+ */
+static struct carp_policy_ops __rcu *carp_policy;
+static DEFINE_MUTEX(carp_policy_mutex);
+
+int carp_register_policy(struct carp_policy_ops *ops)
+{
+    int err = 0;
+
+    if (ops->elect == NULL)
+        return -EINVAL;
+
+    mutex_lock(&carp_policy_mutex);
+    if (rcu_dereference_protected(carp_policy,
+                                  lockdep_is_held(&carp_policy_mutex)))
+        err = -EBUSY;
+    else
+        rcu_assign_pointer(carp_policy, ops);
+    mutex_unlock(&carp_policy_mutex);
+
+    if (!err)
+        pr_info("carp: election policy %s registered\n", ops->name);
+    return err;
+}
+EXPORT_SYMBOL_GPL(carp_register_policy);
+
+void carp_unregister_policy(struct carp_policy_ops *ops)
+{
+    mutex_lock(&carp_policy_mutex);
+    if (rcu_dereference_protected(carp_policy,
+                                  lockdep_is_held(&carp_policy_mutex)) == ops)
+        RCU_INIT_POINTER(carp_policy, NULL);
+    mutex_unlock(&carp_policy_mutex);
+
+    /* the owner tasklets are done with ops after this */
+    synchronize_rcu();
+    pr_info("carp: election policy %s unregistered\n", ops->name);
+}
+EXPORT_SYMBOL_GPL(carp_unregister_policy);
+
+/* Called with carp->lock held */
+static int carp_proto_policy(struct carp *carp, u32 sample, u8 *advbase,
+                             u8 *advskew)
+{
+    struct carp_policy_ops *ops;
+    struct carp_policy_ctx ctx;
+    int verdict = CARP_POLICY_DEFAULT;
+
+    if (likely(rcu_access_pointer(carp_policy) == NULL))
+        return CARP_POLICY_DEFAULT;
+
+    rcu_read_lock();
+    ops = rcu_dereference(carp_policy);
+    if (ops) {
+        ctx.dev          = carp->dev;
+        ctx.vhid         = carp->vhid;
+        ctx.state        = carp->state;
+        ctx.advbase      = *advbase;
+        ctx.advskew      = *advskew;
+        ctx.peer_advbase = carp_sample_advbase(sample);
+        ctx.peer_advskew = carp_sample_advskew(sample);
+        ctx.peer_demote  = carp_sample_demote(sample);
+
+        verdict = ops->elect(&ctx);
+        *advbase = ctx.advbase;
+        *advskew = ctx.advskew;
     }
+    rcu_read_unlock();
 
-    tmp_counter = ntohl(carp_hdr->carp_counter[0]);
-    tmp_counter = tmp_counter<<32;
-    tmp_counter += ntohl(carp_hdr->carp_counter[1]);
+    return verdict;
+}
+
+/* Called from the owner tasklet with carp->lock held */
+static void carp_proto_elect(struct carp *carp, u32 sample, u32 tmp_counter)
+{
+    struct timeval c_tv, ch_tv;
+    u8 advbase = carp_wire_advbase(carp), advskew = carp->advskew;
+    int verdict;
+
+    verdict = carp_proto_policy(carp, sample, &advbase, &advskew);
+    if (verdict == CARP_POLICY_IGNORE)
+        return;
+
+    carp->last_rx = ktime_get();
 
 #if 0
-    if (carp->state == BACKUP && ++carp->carp_adv_counter != tmp_counter) {
-    	carp_dbg("Counter mismatch: remote=%llu, local=%llu.\n", tmp_counter, carp->carp_adv_counter);
+    if (carp->state == BACKUP && (u32)++carp->carp_adv_counter != tmp_counter) {
+    	carp_dbg("Counter mismatch: remote=%u, local=%llu.\n", tmp_counter, carp->carp_adv_counter);
     	carp->cstat.counter_errors++;
-    	goto err_out;
+    	return;
     }
 #endif
 
-    c_tv.tv_sec = carp->advbase;
-    if (carp->advbase == 0 && carp->advskew == 0)
+    c_tv.tv_sec = advbase;
+    if (advbase == 0 && advskew == 0)
     	c_tv.tv_usec = 1 * 1000000 / 256;
     else
-    	c_tv.tv_usec = carp->advskew * 1000000 / 256;
+    	c_tv.tv_usec = advskew * 1000000 / 256;
 
-    ch_tv.tv_sec = carp_hdr->carp_advbase;
-    ch_tv.tv_usec = carp_hdr->carp_advskew * 1000000 / 256;
+    ch_tv.tv_sec = carp_sample_advbase(sample);
+    ch_tv.tv_usec = carp_sample_advskew(sample) * 1000000 / 256;
 
     /*carp_dbg("local=%lu.%lu, remote=%lu.%lu, lcounter=%llu, remcounter=%llu, state=%d\n",
     		carptv.tv_sec, carptv.tv_usec,
@@ -297,13 +1873,30 @@ static int carp_proto_rcv(struct carp_header *carp_hdr)
     		carp->carp_adv_counter, tmp_counter,
     		carp->state);
     */
-    set_bit(CARP_DATA_AVAIL, (long *)&carp->flags);
+    set_bit(CARP_DATA_AVAIL, &carp->events);
+
+    if (verdict == CARP_POLICY_MASTER) {
+        if (carp->state == BACKUP)
+            carp_master_down((unsigned long)carp);
+        else if (carp->state == INIT)
+            carp_set_state(carp, MASTER);
+        return;
+    }
+
+    if (verdict == CARP_POLICY_BACKUP) {
+        if (carp->state != BACKUP) {
+            carp_proto_set_counter(carp, tmp_counter);
+            carp_set_state(carp, BACKUP);
+        }
+        carp_set_run(carp, 0);
+        return;
+    }
 
     switch (carp->state) {
     	case INIT:
             // FIXME: should be break; now
     		if (timeval_before(&ch_tv, &c_tv)) {
-    			carp->carp_adv_counter = tmp_counter;
+    			carp_proto_set_counter(carp, tmp_counter);
     			carp_set_state(carp, BACKUP);
     		} else {
     			carp_set_state(carp, MASTER);
@@ -311,7 +1904,7 @@ static int carp_proto_rcv(struct carp_header *carp_hdr)
     		break;
     	case MASTER:
     		if (timeval_before(&ch_tv, &c_tv)) {
-    			carp->carp_adv_counter = tmp_counter;
+    			carp_proto_set_counter(carp, tmp_counter);
     			carp_set_state(carp, BACKUP);
     		}
     		break;
@@ -319,36 +1912,50 @@ static int carp_proto_rcv(struct carp_header *carp_hdr)
 
 #if 0
             if (carp_preempt && timeval_before(&c_tv, &ch_tv) &&
-                carp_hdr->carp_demote >= carp_demote_count(carp)) {
+                carp_sample_demote(sample) >= carp_demote_count(carp)) {
                 carp_master_down((unsigned long)carp);
                 break;
             }
 
-            if (carp_hdr->carp_demote > carp_demote_count(carp)) {
+            if (carp_sample_demote(sample) > carp_demote_count(carp)) {
                 carp_master_down((unsigned long)carp);
                 break;
             }
 #endif
 
-            c_tv.tv_sec = carp->advbase * 3;
+            c_tv.tv_sec = advbase * 3;
             if (carp->advbase && timeval_before(&c_tv, &ch_tv)) {
-                mod_timer(&carp->md_timer, jiffies + 1);
+                carp_master_down((unsigned long)carp);
                 break;
     		}
 
             carp_set_run(carp, 0);
     		break;
     }
-
-err_out:
-    spin_unlock(&carp->lock);
-    return err;
 }
 
-void carp_advertise(unsigned long data)
+/*
+ * Owner tasklet of a carp, scheduled by the receive path and the master
+ * down timer.
+ */
+void carp_proto_owner(unsigned long data)
 {
     struct carp *carp = (struct carp *)data;
-    carp_proto_adv(carp);
+    int master_down;
+    u64 rx;
+
+    spin_lock(&carp->lock);
+
+    master_down = test_and_clear_bit(CARP_MASTER_DOWN, &carp->events);
+    rx = atomic64_xchg(&carp->rx_sample, 0);
+
+    /* A fresh advertisement supersedes a master down that raced with it */
+    if (upper_32_bits(rx) & CARP_SAMPLE_VALID)
+        carp_proto_elect(carp, upper_32_bits(rx), lower_32_bits(rx));
+    else if (master_down)
+        carp_master_down((unsigned long)carp);
+
+    spin_unlock(&carp->lock);
 }
 
 /*-------------------------- Registration functions --------------------------*/
@@ -359,9 +1966,19 @@ static struct net_protocol carp_protocol __read_mostly = {
 
 int carp_register_protocol(void)
 {
-    int res;
+    struct carp_verify_batch *batch;
+    int res, cpu;
     carp_dbg("Registering CARP protocol on %d", IPPROTO_CARP);
 
+    for_each_possible_cpu(cpu) {
+        batch = &per_cpu(carp_verify_batches, cpu);
+        skb_queue_head_init(&batch->queue);
+        spin_lock_init(&batch->done_lock);
+        INIT_LIST_HEAD(&batch->done);
+        tasklet_init(&batch->tasklet, carp_proto_verify_flush,
+                     (unsigned long)batch);
+    }
+
     res = inet_add_protocol(&carp_protocol, IPPROTO_CARP);
     if (res)
         return res;
@@ -371,12 +1988,19 @@ int carp_register_protocol(void)
 
 int carp_unregister_protocol(void)
 {
-    int res;
+    int res, cpu;
     carp_dbg("Unregistering CARP protocol");
 
     res = inet_del_protocol(&carp_protocol, IPPROTO_CARP);
     if (res)
         return res;
 
+    synchronize_net();
+    for_each_possible_cpu(cpu)
+        tasklet_kill(&per_cpu(carp_verify_batches, cpu).tasklet);
+
+    /* transforms released by the last in-flight verification */
+    flush_scheduled_work();
+
     return 0;
 }
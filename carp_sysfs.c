@@ -106,18 +106,29 @@ static ssize_t carp_store_adv_base(struct device *dev,
     }
 
     if (new_value < 0 || new_value > 255) {
-        pr_err("%s: invalid adv_base value, %d not in range 1-%d; rejected.\n",
+        pr_err("%s: invalid adv_base value, %d not in range 0-%d; rejected.\n",
                carp->name, new_value, 255);
         ret = -EINVAL;
         goto out;
     }
 
-    pr_info("%s: setting advertisement base to %d.\n", carp->name, new_value);
-    carp->advbase = new_value;
+    if (!rtnl_trylock())
+        return restart_syscall();
 
-    carp->md_timeout  = carp_calculate_timeout(3, new_value, carp->advskew);
-    carp->adv_timeout = carp_calculate_timeout(1, new_value, carp->advskew);
+    if (carp_set_intervals(carp, new_value, carp->advskew, carp->adv_msec)) {
+        pr_err("%s: adv_base %d exceeds the master down bound of %u ms; rejected.\n",
+               carp->name, new_value, carp->md_bound_ms);
+        ret = -ERANGE;
+    } else {
+        pr_info("%s: setting advertisement base to %d.\n", carp->name, new_value);
+        /* the nodes share the interface's interval */
+        if (carp_proto_build_adv(carp))
+            ret = -ENOMEM;
+        else
+            carp_node_sync(carp);
+    }
 
+    rtnl_unlock();
 out:
     return ret;
 }
@@ -147,18 +158,26 @@ static ssize_t carp_store_adv_skew(struct device *dev,
     }
 
     if (new_value < 0 || new_value > 255) {
-        pr_err("%s: invalid adv_skew value, %d not in range 1-%d; rejected.\n",
-               carp->name, new_value, 254);
+        pr_err("%s: invalid adv_skew value, %d not in range 0-%d; rejected.\n",
+               carp->name, new_value, 255);
         ret = -EINVAL;
         goto out;
     }
 
-    pr_info("%s: setting advertisement skew to %d.\n", carp->name, new_value);
-    carp->advskew = new_value;
+    if (!rtnl_trylock())
+        return restart_syscall();
 
-    carp->md_timeout  = carp_calculate_timeout(3, carp->advbase, new_value);
-    carp->adv_timeout = carp_calculate_timeout(1, carp->advbase, new_value);
+    if (carp_set_intervals(carp, carp->advbase, new_value, carp->adv_msec)) {
+        pr_err("%s: adv_skew %d exceeds the master down bound of %u ms; rejected.\n",
+               carp->name, new_value, carp->md_bound_ms);
+        ret = -ERANGE;
+    } else {
+        pr_info("%s: setting advertisement skew to %d.\n", carp->name, new_value);
+        if (carp_proto_build_adv(carp))
+            ret = -ENOMEM;
+    }
 
+    rtnl_unlock();
 out:
     return ret;
 }
@@ -166,16 +185,223 @@ out:
 static DEVICE_ATTR(advskew, S_IRUGO | S_IWUSR,
                    carp_show_adv_skew, carp_store_adv_skew);
 
+static ssize_t carp_show_adv_msec(struct device *dev,
+                                  struct device_attribute *attr,
+                                  char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    return sprintf(buf, "%u\n", carp->adv_msec);
+}
+
+/*
+ * Millisecond advertisement interval. When non zero it replaces advbase for
+ * the local timers and advskew becomes a 1/256th fraction of it. It is
+ * advertised in place of advbase, so it is limited to CARP_MAX_ADV_MSEC;
+ * longer intervals are set with advbase and advskew.
+ */
+static ssize_t carp_store_adv_msec(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, ssize_t count)
+{
+    unsigned int new_value;
+    int ret = count;
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%u", &new_value) != 1) {
+        pr_err("%s: no adv_msec value specified.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (new_value > CARP_MAX_ADV_MSEC) {
+        pr_err("%s: invalid adv_msec value, %u not in range 0-%d; rejected.\n",
+               carp->name, new_value, CARP_MAX_ADV_MSEC);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    if (carp_set_intervals(carp, carp->advbase, carp->advskew, new_value)) {
+        pr_err("%s: adv_msec %u exceeds the master down bound of %u ms; rejected.\n",
+               carp->name, new_value, carp->md_bound_ms);
+        ret = -ERANGE;
+    } else {
+        pr_info("%s: setting advertisement interval to %u ms.\n", carp->name, new_value);
+        /* the template announces the mode */
+        if (carp_proto_build_adv(carp))
+            ret = -ENOMEM;
+        else
+            carp_node_sync(carp);
+    }
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(adv_msec, S_IRUGO | S_IWUSR,
+                   carp_show_adv_msec, carp_store_adv_msec);
+
+static ssize_t carp_show_md_bound(struct device *dev,
+                                  struct device_attribute *attr,
+                                  char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    return sprintf(buf, "%u\n", carp->md_bound_ms);
+}
+
+/*
+ * Upper bound on the master down detection time in milliseconds. Interval
+ * settings exceeding it are rejected, and master down events that fire
+ * later than it after the last advertisement are counted as overruns.
+ */
+static ssize_t carp_store_md_bound(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, ssize_t count)
+{
+    unsigned int new_value;
+    int ret = count;
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%u", &new_value) != 1) {
+        pr_err("%s: no md_bound_ms value specified.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    if (new_value && ktime_to_ms(carp->md_timeout) > new_value) {
+        pr_err("%s: master down time %lld ms exceeds md_bound_ms %u; rejected.\n",
+               carp->name, ktime_to_ms(carp->md_timeout), new_value);
+        ret = -ERANGE;
+    } else {
+        pr_info("%s: setting master down bound to %u ms.\n", carp->name, new_value);
+        carp->md_bound_ms = new_value;
+        carp_node_sync(carp);
+    }
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(md_bound_ms, S_IRUGO | S_IWUSR,
+                   carp_show_md_bound, carp_store_md_bound);
+
+static ssize_t carp_show_rx_rate(struct device *dev,
+                                 struct device_attribute *attr,
+                                 char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    return sprintf(buf, "%u\n", carp->rx_rate);
+}
+
+/*
+ * Advertisements per second accepted from a single source before the HMAC
+ * is checked; 0 disables rate limiting.
+ */
+static ssize_t carp_store_rx_rate(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, ssize_t count)
+{
+    unsigned int new_value;
+    int ret = count;
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%u", &new_value) != 1) {
+        pr_err("%s: no rx_rate value specified.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (new_value > HZ * 1000) {
+        pr_err("%s: invalid rx_rate value, %u not in range 0-%d; rejected.\n",
+               carp->name, new_value, HZ * 1000);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    pr_info("%s: setting receive rate limit to %u/s.\n", carp->name, new_value);
+    carp->rx_rate = new_value;
+    carp_node_sync(carp);
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(rx_rate, S_IRUGO | S_IWUSR,
+                   carp_show_rx_rate, carp_store_rx_rate);
+
+static ssize_t carp_show_rx_burst(struct device *dev,
+                                  struct device_attribute *attr,
+                                  char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    return sprintf(buf, "%u\n", carp->rx_burst);
+}
+
+static ssize_t carp_store_rx_burst(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, ssize_t count)
+{
+    unsigned int new_value;
+    int ret = count;
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%u", &new_value) != 1) {
+        pr_err("%s: no rx_burst value specified.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (new_value < 1 || new_value > 1000) {
+        pr_err("%s: invalid rx_burst value, %u not in range 1-%d; rejected.\n",
+               carp->name, new_value, 1000);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    pr_info("%s: setting receive burst to %u.\n", carp->name, new_value);
+    carp->rx_burst = new_value;
+    carp_node_sync(carp);
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(rx_burst, S_IRUGO | S_IWUSR,
+                   carp_show_rx_burst, carp_store_rx_burst);
+
 
 static ssize_t carp_show_carpdev(struct device *dev,
                                   struct device_attribute *attr,
                                   char *buf)
 {
     struct carp *carp = to_carp(dev);
-    if (carp->odev != NULL)
-        return sprintf(buf, "%s\n", carp->odev->name);
+    struct net_device *odev;
+    ssize_t res;
+
+    /* the carpdev can be unregistered under us, and is put after a grace period */
+    rcu_read_lock();
+    odev = ACCESS_ONCE(carp->odev);
+    if (odev != NULL)
+        res = sprintf(buf, "%s\n", odev->name);
     else
-        return sprintf(buf, "(none)\n");
+        res = sprintf(buf, "(none)\n");
+    rcu_read_unlock();
+    return res;
 }
 
 static ssize_t carp_store_carpdev(struct device *dev,
@@ -192,12 +418,15 @@ static ssize_t carp_store_carpdev(struct device *dev,
         goto out;
     }
 
+    if (!rtnl_trylock())
+        return restart_syscall();
+
     if (carp_set_interface(carp, new_ifname) != 0) {
         pr_err("%s: unable to set carpdev to %s.\n", carp->name, new_ifname);
         ret = -EINVAL;
-        goto out;
     }
 
+    rtnl_unlock();
 out:
     return ret;
 }
@@ -242,6 +471,7 @@ static ssize_t carp_store_state(struct device *dev,
         goto out;
     }
 
+    spin_lock_bh(&carp->lock);
     if (new_state != INIT && new_state != carp->state) {
         switch (new_state) {
             case BACKUP:
@@ -255,6 +485,7 @@ static ssize_t carp_store_state(struct device *dev,
                 break;
         }
     }
+    spin_unlock_bh(&carp->lock);
 
 out:
     return ret;
@@ -291,9 +522,22 @@ static ssize_t carp_store_vhid(struct device *dev,
         goto out;
     }
 
-    pr_info("%s: setting vhid to %d.\n", carp->name, new_value);
-    carp->vhid = new_value;
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    if (carp_port_set_vhid(carp, new_value)) {
+        pr_err("%s: vhid %d already in use on %s; rejected.\n",
+               carp->name, new_value,
+               carp->odev ? carp->odev->name : "(none)");
+        ret = -EEXIST;
+    } else {
+        pr_info("%s: setting vhid to %d.\n", carp->name, new_value);
+        carp_set_vmac(carp);
+        if (carp_proto_build_adv(carp))
+            ret = -ENOMEM;
+    }
 
+    rtnl_unlock();
 out:
     return ret;
 }
@@ -301,12 +545,261 @@ out:
 static DEVICE_ATTR(vhid, S_IRUGO | S_IWUSR,
                    carp_show_vhid, carp_store_vhid);
 
+static ssize_t carp_show_auth(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    return sprintf(buf, "%s\n", carp_crypto_auth_name(carp));
+}
+
+static ssize_t carp_store_auth(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf, ssize_t count)
+{
+    int ret = count;
+    char new_auth[CARP_AUTH_NAME_LEN];
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%15s", new_auth) != 1) {
+        pr_err("%s: no auth value specified.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    ret = carp_crypto_set_auth(carp, new_auth);
+    if (ret) {
+        pr_err("%s: unable to set auth to %s.\n", carp->name, new_auth);
+        if (ret == -ENOENT)
+            ret = -EINVAL;
+    } else {
+        pr_info("%s: setting auth to %s.\n", carp->name, new_auth);
+        ret = count;
+    }
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(auth, S_IRUGO | S_IWUSR,
+                   carp_show_auth, carp_store_auth);
+
+static const char *carp_bundle_modes[] = { "off", "auto", "on" };
+
+static ssize_t carp_show_bundle(struct device *dev,
+                                struct device_attribute *attr,
+                                char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    return sprintf(buf, "%s\n", carp_bundle_modes[carp->bundle]);
+}
+
+/*
+ * Bundled advertisements for the vhids of the interface: "off", "auto" to
+ * bundle while a peer announces support for it, or "on".
+ */
+static ssize_t carp_store_bundle(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, ssize_t count)
+{
+    int ret = count;
+    int i;
+    char new_mode[8];
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%7s", new_mode) != 1) {
+        pr_err("%s: no bundle mode specified.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(carp_bundle_modes); i++)
+        if (strcmp(new_mode, carp_bundle_modes[i]) == 0)
+            break;
+
+    if (i == ARRAY_SIZE(carp_bundle_modes)) {
+        pr_err("%s: invalid bundle mode %s; rejected.\n", carp->name, new_mode);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    pr_info("%s: setting bundle mode to %s.\n", carp->name, new_mode);
+    carp->bundle = i;
+
+    /* the templates announce whether we accept bundles */
+    if (carp_proto_build_adv(carp))
+        ret = -ENOMEM;
+    carp_node_sync(carp);
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(bundle, S_IRUGO | S_IWUSR,
+                   carp_show_bundle, carp_store_bundle);
+
+static ssize_t carp_show_nodes(struct device *dev,
+                               struct device_attribute *attr,
+                               char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    struct carp *node;
+    int len = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(node, &carp->cold->nodes, node_entry)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%u:%u ",
+                         node->vhid, node->advskew);
+    rcu_read_unlock();
+
+    if (len)
+        buf[len - 1] = '\n';
+    return len;
+}
+
+/*
+ * Add or remove a carp node: "+vhid[:advskew]" or "-vhid".
+ */
+static ssize_t carp_store_nodes(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, ssize_t count)
+{
+    int ret = count;
+    unsigned int vhid, advskew = 0;
+    char op;
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%c%u:%u", &op, &vhid, &advskew) < 2 ||
+        (op != '+' && op != '-')) {
+        pr_err("%s: nodes takes +vhid[:advskew] or -vhid.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (vhid < 1 || vhid > 255 || advskew > 255) {
+        pr_err("%s: invalid node %u:%u; rejected.\n",
+               carp->name, vhid, advskew);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    if (op == '+')
+        ret = carp_node_add(carp, vhid, advskew);
+    else
+        ret = carp_node_del(carp, vhid);
+
+    if (ret) {
+        pr_err("%s: unable to %s node %u.\n", carp->name,
+               op == '+' ? "add" : "remove", vhid);
+    } else {
+        pr_info("%s: %s node %u.\n", carp->name,
+                op == '+' ? "added" : "removed", vhid);
+        ret = count;
+    }
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(nodes, S_IRUGO | S_IWUSR,
+                   carp_show_nodes, carp_store_nodes);
+
+static ssize_t carp_show_peers(struct device *dev,
+                               struct device_attribute *attr,
+                               char *buf)
+{
+    struct carp *carp = to_carp(dev);
+    struct carp_peer *peer;
+    int len = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(peer, &carp->cold->peers, entry)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%pI4 ", &peer->addr);
+    rcu_read_unlock();
+
+    if (len)
+        buf[len - 1] = '\n';
+    return len;
+}
+
+/*
+ * Add or remove a unicast peer: "+a.b.c.d" or "-a.b.c.d". With no peers,
+ * advertisements are multicast.
+ */
+static ssize_t carp_store_peers(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, ssize_t count)
+{
+    int ret = count;
+    __be32 addr;
+    char op, addr_str[16];
+    struct carp *carp = to_carp(dev);
+
+    if (sscanf(buf, "%c%15s", &op, addr_str) != 2 ||
+        (op != '+' && op != '-')) {
+        pr_err("%s: peers takes +address or -address.\n", carp->name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!in4_pton(addr_str, -1, (u8 *)&addr, '\0', NULL)) {
+        pr_err("%s: invalid peer address %s; rejected.\n",
+               carp->name, addr_str);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    if (op == '+')
+        ret = carp_proto_peer_add(carp, addr);
+    else
+        ret = carp_proto_peer_del(carp, addr);
+
+    if (ret) {
+        pr_err("%s: unable to %s peer %pI4.\n", carp->name,
+               op == '+' ? "add" : "remove", &addr);
+    } else {
+        pr_info("%s: %s peer %pI4.\n", carp->name,
+                op == '+' ? "added" : "removed", &addr);
+        ret = count;
+    }
+
+    rtnl_unlock();
+out:
+    return ret;
+}
+
+static DEVICE_ATTR(peers, S_IRUGO | S_IWUSR,
+                   carp_show_peers, carp_store_peers);
+
 static struct attribute *per_carp_attrs[] = {
     &dev_attr_advbase.attr,
     &dev_attr_advskew.attr,
+    &dev_attr_adv_msec.attr,
+    &dev_attr_md_bound_ms.attr,
+    &dev_attr_rx_rate.attr,
+    &dev_attr_rx_burst.attr,
     &dev_attr_carpdev.attr,
     &dev_attr_state.attr,
     &dev_attr_vhid.attr,
+    &dev_attr_auth.attr,
+    &dev_attr_nodes.attr,
+    &dev_attr_bundle.attr,
+    &dev_attr_peers.attr,
     NULL,
 };
 
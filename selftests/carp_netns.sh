@@ -0,0 +1,226 @@
+#!/bin/bash
+#
+# carp_netns.sh -- failover, bundle and node tests for ip_carp
+#
+# Two network namespaces are joined by a veth pair and each gets a carp
+# interface on its end: carp-a with advskew 0, which should win, and carp-b
+# with advskew 100. The tests drive the interfaces through sysfs, read
+# them back through /proc/net/carp and carpctl, and wait for the state the
+# protocol should reach.
+#
+# The module targets Linux 3.9 era kernels (tasklet_hrtimer, the 3.9
+# ahash and u64_stats APIs). Build it against the running kernel with
+# "make" at the top of the tree, then run this script as root. Exits 4,
+# the kselftest skip code, when it cannot run.
+
+ksft_skip=4
+
+NS_A=carp-a
+NS_B=carp-b
+VIP=10.0.0.100
+TIMEOUT=15
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+ret=0
+
+log_test()
+{
+    local rc=$1 desc=$2
+
+    if [ "$rc" -eq 0 ]; then
+        printf "    TEST: %-50s [ OK ]\n" "$desc"
+    else
+        printf "    TEST: %-50s [FAIL]\n" "$desc"
+        ret=1
+    fi
+}
+
+nsx()
+{
+    local ns=$1; shift
+    ip netns exec "$ns" "$@"
+}
+
+carp_set()
+{
+    local ns=$1 attr=$2 val=$3
+    nsx "$ns" sh -c "echo '$val' > /sys/class/net/carp0/carp/$attr"
+}
+
+carp_get()
+{
+    local ns=$1 attr=$2
+    nsx "$ns" cat "/sys/class/net/carp0/carp/$attr"
+}
+
+carp_proc()
+{
+    local ns=$1 key=$2
+    nsx "$ns" sed -n "s/^$key: //p" /proc/net/carp/carp0
+}
+
+node_state()
+{
+    local ns=$1 vhid=$2
+    nsx "$ns" sed -n "s/^Node: vhid $vhid skew [0-9]* \([A-Z]*\) .*/\1/p" \
+        /proc/net/carp/carp0
+}
+
+# wait_for <timeout> <command...>: retry the command every 200ms
+wait_for()
+{
+    local i n=$(($1 * 5)); shift
+
+    for ((i = 0; i < n; i++)); do
+        "$@" && return 0
+        sleep 0.2
+    done
+    return 1
+}
+
+is_state()
+{
+    [ "$(carp_get "$1" state)" = "$2" ]
+}
+
+is_node_state()
+{
+    [ "$(node_state "$1" "$2")" = "$3" ]
+}
+
+cleanup()
+{
+    ip netns del $NS_A 2>/dev/null
+    ip netns del $NS_B 2>/dev/null
+}
+
+setup()
+{
+    local ns addr skew dev
+
+    ip netns add $NS_A || return 1
+    ip netns add $NS_B || return 1
+    ip link add va netns $NS_A type veth peer name vb netns $NS_B || return 1
+
+    for ns in $NS_A $NS_B; do
+        if [ $ns = $NS_A ]; then
+            addr=10.0.0.1 skew=0 dev=va
+        else
+            addr=10.0.0.2 skew=100 dev=vb
+        fi
+
+        nsx $ns ip link set lo up
+        nsx $ns ip addr add $addr/24 dev $dev
+        nsx $ns ip link set $dev up
+        nsx $ns ip link add carp0 type carp || return 1
+        carp_set $ns carpdev $dev || return 1
+        carp_set $ns vhid 1 || return 1
+        carp_set $ns advskew $skew || return 1
+        nsx $ns ip addr add $VIP/24 dev carp0
+        nsx $ns ip link set carp0 up || return 1
+    done
+}
+
+test_failover()
+{
+    echo "Failover"
+
+    wait_for $TIMEOUT is_state $NS_A MASTER
+    log_test $? "lower advskew becomes master"
+    wait_for $TIMEOUT is_state $NS_B BACKUP
+    log_test $? "higher advskew stays backup"
+
+    nsx $NS_A ip link set va down
+    wait_for $TIMEOUT is_state $NS_B MASTER
+    log_test $? "backup takes over when the master's carpdev goes down"
+
+    nsx $NS_A ip link set va up
+    wait_for $TIMEOUT eval '[ "$(carp_get $NS_A state)" != INIT ]'
+    log_test $? "old master rejoins once its carpdev is back"
+
+    carp_set $NS_A carpdev va
+    wait_for $TIMEOUT eval '[ "$(carp_get $NS_A state)" != INIT ]'
+    log_test $? "carpdev rebind keeps the carp running"
+
+    [ -n "$TOP" ] && [ -x "$TOP/carpctl" ] || return 0
+    nsx $NS_A "$TOP/carpctl" | grep -q "VHID=1"
+    log_test $? "carpctl reads the parameters back"
+}
+
+test_nodes()
+{
+    echo "Nodes"
+
+    carp_set $NS_A nodes +2:0
+    carp_set $NS_B nodes +2:100
+    [ "$(carp_get $NS_A nodes)" = "2:0" ]
+    log_test $? "node added through sysfs"
+
+    wait_for $TIMEOUT is_node_state $NS_A 2 MASTER
+    log_test $? "node with lower advskew becomes master"
+    wait_for $TIMEOUT is_node_state $NS_B 2 BACKUP
+    log_test $? "node with higher advskew stays backup"
+
+    nsx $NS_A ip link set va down
+    wait_for $TIMEOUT is_node_state $NS_B 2 MASTER
+    log_test $? "node fails over with its interface"
+    nsx $NS_A ip link set va up
+}
+
+# bundles go out from whichever side is master for the vhids
+bundles_seen()
+{
+    [ "$(carp_proc $NS_A "Bundles Sent")" -gt 0 ] &&
+    [ "$(carp_proc $NS_B "Bundles Rcvd")" -gt 0 ] && return 0
+    [ "$(carp_proc $NS_B "Bundles Sent")" -gt 0 ] &&
+    [ "$(carp_proc $NS_A "Bundles Rcvd")" -gt 0 ]
+}
+
+test_bundle()
+{
+    echo "Bundles"
+
+    carp_set $NS_A bundle on
+    carp_set $NS_B bundle on
+    [ "$(carp_get $NS_A bundle)" = on ]
+    log_test $? "bundle mode set through sysfs"
+
+    wait_for $TIMEOUT bundles_seen
+    log_test $? "bundled advertisements sent and received"
+
+    [ "$(carp_proc $NS_A "HMAC Errors")" -eq 0 ] &&
+    [ "$(carp_proc $NS_B "HMAC Errors")" -eq 0 ]
+    log_test $? "bundles verify"
+
+    [ "$(node_state $NS_A 2)" != INIT ] && [ "$(node_state $NS_B 2)" != INIT ]
+    log_test $? "nodes keep running on bundles"
+
+    carp_set $NS_A nodes -2
+    [ -z "$(carp_get $NS_A nodes)" ]
+    log_test $? "node removed through sysfs"
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "SKIP: need root"
+    exit $ksft_skip
+fi
+
+if ! lsmod | grep -q '^ip_carp '; then
+    if [ ! -f "$TOP/ip_carp.ko" ] || ! insmod "$TOP/ip_carp.ko"; then
+        echo "SKIP: cannot load ip_carp"
+        exit $ksft_skip
+    fi
+fi
+
+trap cleanup EXIT
+
+if ! setup; then
+    echo "SKIP: cannot set up the namespaces"
+    exit $ksft_skip
+fi
+
+test_failover
+test_nodes
+test_bundle
+
+exit $ret